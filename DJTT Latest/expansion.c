@@ -21,6 +21,7 @@
 // rgreen 2009-11-24
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "constants.h"
 #include "expansion.h"
 
@@ -217,7 +218,12 @@ void exp_key_calc(void)
 //  a-j = the 10 bit ADC value, note the leading zero.
 //  .   = don't care, do not use, could be anything.
 //
-uint16_t exp_adc_read(uint8_t channel)
+// The ADC samples its input during the second byte and holds the sample
+// while it converts, so if "next_mux" isn't EXP_MUX_KEEP the multiplexer is
+// switched to that input straight after the second byte. It then settles
+// while the conversion finishes instead of in front of the next read.
+//
+static uint16_t exp_adc_read_mux(uint8_t channel, uint8_t next_mux)
 {
     // Disable the LED controller by making sure it's latch is low. The LED
     // and ADC chips share the same SPI data and clock lines, so it's
@@ -235,6 +241,10 @@ uint16_t exp_adc_read(uint8_t channel)
     spi_transmit(0b00000001);
     // Second byte sets up single-channel-read the channel.
     uint8_t topbyte = spi_transmit(byte2);
+    // The input is sampled, start switching the multiplexer.
+    if (next_mux != EXP_MUX_KEEP) {
+        PORTD = (PORTD & ~EXP_MUX_PINS) | (next_mux << 2);
+    }
     // Third byte shifts in the remaining values.
     uint8_t lowbyte = spi_transmit(0b00000000);
     // Put the ADC chip back into hibernation by pulling the select pin high.
@@ -244,6 +254,62 @@ uint16_t exp_adc_read(uint8_t channel)
     return ((topbyte & 0x07) << 8) | lowbyte;
 }
 
+uint16_t exp_adc_read(uint8_t channel)
+{
+    return exp_adc_read_mux(channel, EXP_MUX_KEEP);
+}
+
+#ifdef MULTIPLEX_ANALOG
+
+// The order in which exp_analog_scan() reads the analog inputs. ADC
+// channels 0-2 are read directly and the eight multiplexer inputs on ADC
+// channel 3 end up in values 3-10. Each multiplexer read selects the input
+// for the next one, and where possible a direct read is slotted in between
+// to give the multiplexer a whole conversion to settle. The last entry
+// selects the first multiplexer input again, ready for the next scan.
+//
+typedef struct {
+    uint8_t channel;   // ADC channel to read
+    uint8_t value;     // where to store it
+    uint8_t next_mux;  // multiplexer input to switch to, or EXP_MUX_KEEP
+} exp_schedule_t;
+
+static const exp_schedule_t exp_schedule[] PROGMEM = {
+    { 3,  3, 1 },
+    { 0,  0, EXP_MUX_KEEP },
+    { 3,  4, 2 },
+    { 1,  1, EXP_MUX_KEEP },
+    { 3,  5, 3 },
+    { 2,  2, EXP_MUX_KEEP },
+    { 3,  6, 4 },
+    { 3,  7, 5 },
+    { 3,  8, 6 },
+    { 3,  9, 7 },
+    { 3, 10, 0 },
+};
+
+// Read all NUM_ANALOG analog inputs into "value" following the schedule.
+//
+void exp_analog_scan(uint16_t *value)
+{
+    // The multiplexer select lines are the digital ports switched to
+    // outputs. The first time through, and if anything has turned them back
+    // into inputs since, select the first multiplexer input up front.
+    if ((DDRD & EXP_MUX_PINS) != EXP_MUX_PINS) {
+        DDRD |= EXP_MUX_PINS;
+        PORTD &= ~EXP_MUX_PINS;
+    }
+
+    for (uint8_t i=0; i < sizeof(exp_schedule) / sizeof(exp_schedule[0]); ++i) {
+        uint8_t channel = pgm_read_byte(&exp_schedule[i].channel);
+        uint8_t slot = pgm_read_byte(&exp_schedule[i].value);
+        uint8_t next_mux = pgm_read_byte(&exp_schedule[i].next_mux);
+        value[slot] = exp_adc_read_mux(channel, next_mux);
+    }
+}
+
+#endif // MULTIPLEX_ANALOG
+
 // ---------------------------------------------------------------------------
 
 #ifdef MIDIFIGHTER_PRO
@@ -56,7 +56,15 @@ void exp_buffer_digital_inputs(void);
 uint8_t exp_key_read(void);
 void exp_key_calc(void);
 
+// Multiplexer select lines (the first three digital ports), and the value
+// passed as "next_mux" to leave the multiplexer alone.
+#define EXP_MUX_PINS (EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2)
+#define EXP_MUX_KEEP 0xff
+
 uint16_t exp_adc_read(uint8_t channel);
+#ifdef MULTIPLEX_ANALOG
+void exp_analog_scan(uint16_t *value);
+#endif
 
 // ---------------------------------------------------------------------------
 
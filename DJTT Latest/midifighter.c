@@ -492,24 +492,10 @@ void Midifighter_Task(void)
         static uint16_t adc_value[NUM_ANALOG];
 
 #ifdef MULTIPLEX_ANALOG
-        adc_value[0] = exp_adc_read(0);
-        adc_value[1] = exp_adc_read(1);
-        adc_value[2] = exp_adc_read(2);
-
-        // switch the digital ports to output high (source, DDDn=1, PORTDn=1)
-        DDRD |= EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2;
-        PORTD |= EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2;
-
-        // read the additional 8 multiplexed ADC values from ADC3 by
-        // iterating through the channels on the multiplexer.
-        for (uint8_t i=0; i<8; ++i) {
-            // set the multiplexer port we want to read.
-            PORTD = i << 2;  // EXP_DIGITAL0 is PD2, so shift up two places.
-            // wait a moment
-            // _delay_ms(1);
-            // read the analog input.
-            adc_value[3+i] = exp_adc_read(3);
-        }
+        // Read the three direct ADC channels and the 8 multiplexed values
+        // on ADC3. The scan switches the multiplexer while the ADC is
+        // still converting, so there's no need to wait for it to settle.
+        exp_analog_scan(adc_value);
 #else
         // Read the full 10-bit value from each ADC channel. Take the
         // average of several samples to smooth out the noise.
@@ -20,6 +20,7 @@
 //
 // rgreen 2009-10-17
 
+#include <stdbool.h>
 #include <avr/io.h>
 #include "constants.h"
 #include "spi.h"
@@ -39,6 +40,8 @@ void adc_setup(void)
     //PORTB |= ADC_SELECT;
 	
 	spi_install_slave(SPI_SLAVE_ADC, SPI_PORT_B, ADC_SELECT, SPI_LOW_TO_SELECT);
+	spi_configure_slave(SPI_SLAVE_ADC, SPI_CLOCK_ADC, SPI_MODE_0);
+	spi_install_client(SPI_SLAVE_ADC, SPI_PRIORITY_ADC, SPI_BUDGET_ADC_US, 0);
 }
 
 
@@ -47,20 +50,35 @@ void adc_setup(void)
 //
 //             S E N D            R E A D
 //  byte1  7 6 5 4 3 2 1 0    7 6 5 4 3 2 1 0
-//         . . . . . . . 1    . . . . . . . .
+//         0 0 0 0 0 1 S .    . . . . . . . .
 //
 //  byte2  7 6 5 4 3 2 1 0    7 6 5 4 3 2 1 0
-//         S . A B . . . .    . . . . . 0 a b
+//         A B . . . . . .    . . . 0 a b c d
 //
 //  byte3  7 6 5 4 3 2 1 0    7 6 5 4 3 2 1 0
-//         . . . . . . . .    c d e f g h i j
+//         . . . . . . . .    e f g h i j . .
 //
 //  S   = select single ended (1) or differential (0) measurement.
 //  AB  = the port number, four ports numbered from 0b00 to 0b11.
 //  a-j = the 10 bit ADC value, note the leading zero.
 //  .   = don't care, do not use, could be anything.
 //
-uint16_t adc_read(uint8_t channel)
+// The start bit is sent as early as the zeros in front of it allow, so the
+// top four bits of the value have already arrived with the second byte.
+// Where that's enough, as it is for the analog buttons, adc_finish_short()
+// can stop the conversion there and save a third of the bus time.
+//
+// The conversion is done in two halves. The ADC samples its input during
+// the second byte and holds the sample while it converts, so once
+// adc_start() has returned the input can be changed (e.g. the multiplexer
+// switched to the next input) while adc_finish() shifts out the rest of
+// the result.
+//
+// The ADC must already have the bus, see adc_read() and adc_try_start().
+//
+static uint8_t adc_topbyte;
+
+static void adc_start(uint8_t channel)
 {
     // Disable the LED controller by making sure it's latch is low. The LED
     // and ADC chips share the same SPI data and clock lines, so it's
@@ -70,24 +88,66 @@ uint16_t adc_read(uint8_t channel)
 
     // single channel reads only (no differential) and we select the ADC
     // channel here.
-    uint8_t byte2 = 0b10000000 | ((channel & 0x03) << 4);
+    uint8_t byte2 = (channel & 0x03) << 6;
 
-    // Enable the ADC chip by bringing the select line low.
-    //PORTB &= ~ADC_SELECT;
-	spi_select(SPI_SLAVE_ADC);
-	
-    // First byte wakes up the chip.
-    spi_transmit(0b00000001);
+    // First byte wakes up the chip and asks for a single-ended read.
+    spi_transmit(0b00000110);
     // Second byte sets up single-channel-read the channel.
-    uint8_t topbyte = spi_transmit(byte2);
+    adc_topbyte = spi_transmit(byte2);
+}
+
+
+// Finish the conversion begun by adc_read() or adc_try_start(), give up the
+// bus and return the 10-bit value.
+//
+uint16_t adc_finish(void)
+{
     // Third byte shifts in the remaining values.
     uint8_t lowbyte = spi_transmit(0b00000000);
     // Put the ADC chip back into hibernation by pulling the select pin high.
     //PORTB |= ADC_SELECT;
-	spi_select_none();
+	spi_release(3);
 	
-    // Mask out the "don't care" bits and return the 10-bit value including
-    // the leading zero at bit 11.
-    return  ((topbyte << 8) | lowbyte) & 0x3ff;
+    // Mask out the "don't care" bits and return the 10-bit value.
+    return ((adc_topbyte & 0x0f) << 6) | (lowbyte >> 2);
 	//return 0;
 }
+
+
+// Stop the conversion begun by adc_read() or adc_try_start() after only two
+// bytes, give up the bus and return the top four bits of the value. Taking
+// the select line high part way through aborts the conversion.
+//
+uint8_t adc_finish_short(void)
+{
+	spi_release(2);
+	return adc_topbyte & 0x0f;
+}
+
+
+// Get the 10-bit value from one of the four analog channels, waiting for
+// the bus if necessary.
+//
+uint16_t adc_read(uint8_t channel)
+{
+    // Enable the ADC chip by bringing the select line low. The bus
+    // scheduler sends any pending LED or PIC frame first, and holds us off
+    // until the next millisecond tick if the ADC has used up its bus time.
+    //PORTB &= ~ADC_SELECT;
+	while (!spi_acquire(SPI_SLAVE_ADC)) {}
+	adc_start(channel);
+	return adc_finish();
+}
+
+
+// Start a conversion on one of the four analog channels if the bus is free
+// and the ADC has bus time left this tick, to be completed with
+// adc_finish(). Returns false without waiting otherwise, so the caller can
+// get on with something else and try again later.
+//
+bool adc_try_start(uint8_t channel)
+{
+	if (!spi_acquire(SPI_SLAVE_ADC)) return false;
+	adc_start(channel);
+	return true;
+}
@@ -23,9 +23,15 @@
 #ifndef _ADC_H_INCLUDED
 #define _ADC_H_INCLUDED
 
+#include <stdint.h>
+#include <stdbool.h>
+
 // ADC Functions ---------------------------------------
 
 void adc_setup(void);
 uint16_t adc_read(uint8_t channel);
+bool adc_try_start(uint8_t channel);
+uint16_t adc_finish(void);
+uint8_t adc_finish_short(void);
 
 #endif // _ADC_H_INCLUDED
@@ -0,0 +1,554 @@
+// Background acquisition of the Midifighter Extreme mod's analog inputs.
+
+#include <avr/io.h>
+
+#include "analog.h"
+#include "mod.h"
+#include "expansion.h"
+#include "adc.h"
+#include "eeprom.h"
+#include "curve.h"
+#include "buttons.h"
+#include "key.h"
+#include "constants.h"
+
+#define MULTIPLEXER_PINS (EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2 + EXP_DIGITAL3)
+// Only the select lines are changed, the rest of port D (the PIC's chip
+// select among them) is left as it was.
+#define MULTIPLEXER_SELECT_PINS (EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2)
+#define SELECT_MULTIPLEXER_PIN(x) PORTD = (PORTD & ~MULTIPLEXER_SELECT_PINS) | ((x) << 2)
+
+// The scan list, compiled at boot from the channel map in the EEPROM: the
+// slot (multiplexer pin << 2 | ADC channel) of each pot, sharing a byte
+// with the pot's response curve, and a bit per slot for the buttons, in
+// slot order. Only populated slots are ever read. A frame is
+// ANALOG_SAMPLES passes over the pots followed by one pass over the
+// buttons, and pots and buttons are numbered by their place in the list.
+//
+// As soon as the ADC has sampled an input the multiplexer is switched to
+// the pin of the next input to be read, if that's different, so it settles
+// while the current conversion finishes instead of in front of the next
+// one. The scan wraps around into the next frame.
+#define ANALOG_SLOT_MASK   0x1f
+#define ANALOG_CURVE_SHIFT 5
+typedef char analog_pot_check
+	[(4*ANALOG_MUX_PINS <= ANALOG_SLOT_MASK + 1 && NUM_CURVES <= 8) ? 1 : -1];
+static uint8_t analog_pot[NUM_ANALOG];
+static uint32_t analog_button_mask;
+static uint8_t analog_pots = 0;
+static uint8_t analog_buttons = 0;
+
+// Next conversion in the frame, as the pass (ANALOG_SAMPLES for the
+// buttons) and the pot or button within it, frames completed (for the idle
+// rate) and the multiplexer pin currently selected.
+static uint8_t analog_pass = ANALOG_SAMPLES;
+static uint8_t analog_index = 0;
+static uint8_t analog_frame = 0;
+static uint8_t analog_mux = 0xff;
+
+// The tick the current frame was due on, and whether the scan is waiting
+// for the next one to be due.
+static uint8_t analog_tick = 0;
+static bool analog_waiting = false;
+
+// Levels of the button group being read, four bits per button.
+static uint16_t analog_button_levels = 0;
+
+// Filtered value and noise of each pot, in 10-bit units with 4 fractional
+// bits, and the frames it has left counting as moving. No more than
+// ANALOG_BAND_MAX is ever taken from the noise, so it stops at a byte.
+static uint16_t analog_filter[NUM_ANALOG];
+static uint8_t analog_noise[NUM_ANALOG];
+static uint8_t analog_moving[NUM_ANALOG];
+typedef char analog_noise_check[(ANALOG_BAND_MAX << 3 <= 0xff) ? 1 : -1];
+
+// Sum of the samples each pot has had this frame, at most ANALOG_SAMPLES of
+// 1023, with their number in the top bits.
+#define ANALOG_COUNT_ONE ((uint16_t)1 << 12)
+static uint16_t analog_sum[NUM_ANALOG];
+
+// The noise floor of each pot and the filtering it gets.
+static analog_noise_t analog_floor[NUM_ANALOG];
+
+// Have the filters been started from a first frame? And is every pot to
+// get every sample this frame, for calibration? Both only change between
+// frames, so a pot always gets 1, 2 or 4 samples in a frame.
+static bool analog_primed = false;
+static bool analog_sample_all = false;
+
+// Calibrated range of each pot: its min >> 2, rounded up, and 127.5 /
+// (max - min) in 0.16 fixed point, so mapping a value needs a multiply and
+// a shift but no divide. While calibrating the pots map their whole
+// travel, and the same space holds the extremes each has reached, as
+// 10-bit values >> 2.
+typedef union {
+	struct {
+		uint8_t min;
+		uint16_t scale;
+	} cal;
+	struct {
+		uint8_t min;
+		uint8_t max;
+	} seen;
+} analog_range_t;
+static analog_range_t analog_range[NUM_ANALOG];
+
+// A bit for each pot whose shaped value may have changed since
+// analog_take_changes() was last called.
+static uint8_t analog_changes = 0xff;
+typedef char analog_changes_check[(NUM_ANALOG <= 8) ? 1 : -1];
+
+// Is the range of each pot being recorded?
+static bool analog_calibrating = false;
+
+// A bit for each pot whose new range has yet to be written to the EEPROM.
+// They are written a pot at a time as the write queue has room, so that
+// finishing a calibration never waits on the EEPROM.
+static uint8_t analog_unsaved = 0;
+
+// Take a pot's calibrated range.
+static void analog_set_range (uint8_t i, uint16_t min, uint16_t max)
+{
+	if (min > 0x3fc) min = 0x3fc;
+	uint8_t low = (min + 3) >> 2;
+	min = low << 2;
+	if (max < min + ANALOG_CAL_MIN_SPAN) {
+		max = min + ANALOG_CAL_MIN_SPAN;
+	}
+	analog_range[i].cal.min = low;
+	analog_range[i].cal.scale = ((uint32_t)255 << 15) / (max - min);
+}
+
+// Take a pot's calibrated range from the EEPROM.
+static void analog_load_range (uint8_t i)
+{
+	// Min then max, each stored low byte first.
+	uint16_t range[2];
+	eeprom_read_bytes(range, EE_ANALOG_CALIBRATION + 4*i, sizeof(range));
+	analog_set_range(i, range[0], range[1]);
+}
+
+// Write the range of the first unsaved pot to the EEPROM, if the write
+// queue has room for all of it or "wait" is set. The span is worked back
+// out from the scale, which gives it exactly, and the min is stored as
+// rounded, so the range loads back the same.
+static void analog_save_range (bool wait)
+{
+	if (!wait && eeprom_write_room() < 4) return;
+	uint8_t i = 0;
+	while (!(analog_unsaved & (1 << i))) ++i;
+	analog_unsaved &= ~(1 << i);
+
+	uint16_t min = analog_range[i].cal.min << 2;
+	uint16_t max = min + ((uint32_t)255 << 15) / analog_range[i].cal.scale;
+	uint16_t address = EE_ANALOG_CALIBRATION + 4*i;
+	eeprom_write(address,     min & 0xff);
+	eeprom_write(address + 1, min >> 8);
+	eeprom_write(address + 2, max & 0xff);
+	eeprom_write(address + 3, max >> 8);
+}
+
+// Compile the channel map in the EEPROM into the scan list. Slots past
+// the capacity of the pot or button tables are left out.
+static void analog_compile_map (void)
+{
+	analog_pots = 0;
+	analog_buttons = 0;
+	analog_button_mask = 0;
+	for (uint8_t mux=0; mux < ANALOG_MUX_PINS; ++mux) {
+		uint8_t kinds = eeprom_read(EE_ANALOG_MAP + mux);
+		for (uint8_t channel=0; channel < 4; ++channel) {
+			uint8_t slot = (mux << 2) | channel;
+			switch ((kinds >> (channel << 1)) & 0x03) {
+			case ANALOG_POT:
+				if (analog_pots < NUM_ANALOG) {
+					uint8_t* pot = &analog_pot[analog_pots++];
+					*pot = (*pot & ~ANALOG_SLOT_MASK) | slot;
+				}
+				break;
+			case ANALOG_BUTTON:
+				if (analog_buttons < NUM_ANALOG_BUTTONS) {
+					analog_button_mask |= (uint32_t)1 << slot;
+					++analog_buttons;
+				}
+				break;
+			}
+		}
+	}
+	// The scan starts again from the top of a frame.
+	analog_pass = analog_pots ? 0 : ANALOG_SAMPLES;
+	analog_index = 0;
+	analog_button_levels = 0;
+	for (uint8_t i=0; i < NUM_ANALOG; ++i) {
+		analog_sum[i] = 0;
+	}
+}
+
+// Describe one slot of the channel map as a pot, a button or unused
+// (ANALOG_POT, ANALOG_BUTTON or ANALOG_UNUSED). The scan list is compiled
+// at boot, so the change takes effect from the next one.
+void analog_set_slot (uint8_t slot, uint8_t kind)
+{
+	if (slot >= 4*ANALOG_MUX_PINS || kind > ANALOG_BUTTON) return;
+	uint16_t address = EE_ANALOG_MAP + (slot >> 2);
+	uint8_t shift = (slot & 0x03) << 1;
+	uint8_t kinds = eeprom_read(address);
+	eeprom_write(address, (kinds & ~(0x03 << shift)) | (kind << shift));
+}
+
+// Load the channel map and the calibration and curve of each pot from the
+// EEPROM. The map is compiled by analog_measure_noise().
+void analog_setup ()
+{
+	for (uint8_t i=0; i < NUM_ANALOG; ++i) {
+		uint8_t curve = eeprom_read(EE_ANALOG_CURVE + i);
+		if (curve >= NUM_CURVES) curve = CURVE_LINEAR;
+		analog_pot[i] = curve << ANALOG_CURVE_SHIFT;
+		analog_load_range(i);
+	}
+	analog_measure_noise();
+}
+
+// Map a pot's 10-bit value onto 0..127 using its calibrated range.
+uint8_t analog_position (uint8_t i, uint16_t value)
+{
+	if (analog_calibrating) return value >> 3;
+	uint16_t min = analog_range[i].cal.min << 2;
+	if (value <= min) return 0;
+	uint16_t position = ((uint32_t)(value - min) * analog_range[i].cal.scale) >> 16;
+	return (position > 127) ? 127 : position;
+}
+
+// Map a pot's 10-bit value onto 0..127 through its curve.
+uint8_t analog_shaped (uint8_t i, uint16_t value)
+{
+	return curve_apply(analog_pot[i] >> ANALOG_CURVE_SHIFT, analog_position(i, value));
+}
+
+// Choose the curve a pot uses, and remember it.
+void analog_set_curve (uint8_t i, uint8_t curve)
+{
+	if (i >= NUM_ANALOG || curve >= NUM_CURVES) return;
+	analog_pot[i] = (analog_pot[i] & ANALOG_SLOT_MASK) | (curve << ANALOG_CURVE_SHIFT);
+	analog_changes |= 1 << i;
+	eeprom_write(EE_ANALOG_CURVE + i, curve);
+}
+
+// The pots whose shaped value may have changed since the last call, a bit
+// per pot. Only these need shaping again, which matters for the custom
+// curve as it is read from the EEPROM.
+uint8_t analog_take_changes ()
+{
+	uint8_t changes = analog_changes;
+	analog_changes = 0;
+	return changes;
+}
+
+// Start recording the range of each pot. Calibration carries on in the
+// background until analog_calibrate_finish().
+void analog_calibrate_start ()
+{
+	// The ranges are about to be overwritten, so any not yet saved from
+	// the last calibration have to be written now.
+	while (analog_unsaved) analog_save_range(true);
+	for (uint8_t i=0; i < NUM_ANALOG; ++i) {
+		analog_range[i].seen.min = 0xff;
+		analog_range[i].seen.max = 0;
+	}
+	analog_calibrating = true;
+	analog_changes = 0xff;
+}
+
+// Stop calibrating, and take the new range of every pot that was swept
+// far enough. Pots that weren't get their old calibration back from the
+// EEPROM. The extremes were kept to 4 counts, so the range is pulled in by
+// up to 3 more than ANALOG_CAL_MARGIN. New ranges are saved from
+// analog_poll(), and only for the pots whose mapping actually changed.
+void analog_calibrate_finish ()
+{
+	if (!analog_calibrating) return;
+	analog_calibrating = false;
+	analog_changes = 0xff;
+
+	for (uint8_t i=0; i < NUM_ANALOG; ++i) {
+		uint16_t seen_min = (analog_range[i].seen.min << 2) + 3;
+		uint16_t seen_max = analog_range[i].seen.max << 2;
+		analog_load_range(i);
+		if (seen_max < seen_min + ANALOG_CAL_MIN_SPAN + 2*ANALOG_CAL_MARGIN) {
+			continue;
+		}
+		analog_range_t stored = analog_range[i];
+		analog_set_range(i, seen_min + ANALOG_CAL_MARGIN, seen_max - ANALOG_CAL_MARGIN);
+		if (analog_range[i].cal.min != stored.cal.min ||
+			analog_range[i].cal.scale != stored.cal.scale) {
+			analog_unsaved |= 1 << i;
+		}
+	}
+}
+
+// Add a sample to the ones a pot has had this frame.
+static void analog_filter_sample (uint8_t i, uint16_t sample)
+{
+	analog_sum[i] += sample + ANALOG_COUNT_ONE;
+}
+
+// Decimate the samples a pot has had this frame to one value and run that
+// through the pot's filter. A pot without samples this frame keeps its
+// filtered value. The count is a power of two, so the average is a shift.
+static void analog_filter_frame (uint8_t i)
+{
+	uint8_t count = analog_sum[i] / ANALOG_COUNT_ONE;
+	if (!count) return;
+	uint16_t sum = (analog_sum[i] % ANALOG_COUNT_ONE) << 4;
+	for (; count > 1; count >>= 1) {
+		sum >>= 1;
+	}
+	int16_t x = sum;
+	analog_sum[i] = 0;
+	if (!analog_primed) {
+		analog_filter[i] = x;
+		return;
+	}
+	int16_t error = x - (int16_t)analog_filter[i];
+	analog_filter[i] += error >> analog_floor[i].smoothing;
+
+	int16_t deviation = (error < 0) ? -error : error;
+	if (deviation > 0xff) deviation = 0xff;
+	analog_noise[i] += (deviation - (int16_t)analog_noise[i]) >> ANALOG_NOISE_SHIFT;
+}
+
+// Decide what a pot reports at the end of a frame: its filtered value if
+// that has left the dead band around the last value reported, otherwise
+// the last value again. The value reported is kept in adc_value[], which
+// the dead band is measured from.
+static void analog_hysteresis (uint8_t i)
+{
+	uint16_t value = (analog_filter[i] + 8) >> 4;
+	uint16_t prev = adc_value[i];
+	uint16_t difference = (value > prev) ? value - prev : prev - value;
+
+	uint16_t band = analog_floor[i].band;
+	if (!analog_moving[i]) {
+		band = analog_noise[i] >> 3;
+		if (band < analog_floor[i].band) band = analog_floor[i].band;
+		if (band > ANALOG_BAND_MAX) band = ANALOG_BAND_MAX;
+	}
+
+	if (difference < band) {
+		if (analog_moving[i]) --analog_moving[i];
+		return;
+	}
+	analog_moving[i] = ANALOG_MOVING_FRAMES;
+	adc_value[i] = value;
+	analog_changes |= 1 << i;
+}
+
+// The slot read by entry "index" of pass "pass". Button "index" is the
+// slot of the index'th bit set in the button mask.
+static uint8_t analog_slot (uint8_t pass, uint8_t index)
+{
+	if (pass < ANALOG_SAMPLES) return analog_pot[index] & ANALOG_SLOT_MASK;
+	uint32_t mask = analog_button_mask;
+	uint8_t slot = 0;
+	for (;;) {
+		if ((mask & 1) && !index--) return slot;
+		mask >>= 1;
+		++slot;
+	}
+}
+
+// Move a position in the scan on to the next entry. Returns true if it
+// wraps around into the next frame.
+static bool analog_advance (uint8_t* pass, uint8_t* index)
+{
+	++*index;
+	if (*pass < ANALOG_SAMPLES) {
+		if (*index < analog_pots) return false;
+		*index = 0;
+		if (++*pass < ANALOG_SAMPLES) return false;
+	}
+	if (*index < analog_buttons) return false;
+	*index = 0;
+	*pass = analog_pots ? 0 : ANALOG_SAMPLES;
+	return true;
+}
+
+// Is entry "index" of pass "pass" wanted in frame "frame"? Moving pots get
+// as many samples as their smoothing needs, idle ones only the first pass
+// of every ANALOG_IDLE_FRAMES frames. Everything is sampled until the
+// filters have been primed and while calibrating.
+static bool analog_wanted (uint8_t frame, uint8_t pass, uint8_t index)
+{
+	if (pass == ANALOG_SAMPLES) return true;
+	if (!analog_primed || analog_sample_all) return true;
+	if (analog_moving[index]) {
+		return pass < (1 << analog_floor[index].smoothing);
+	}
+	return pass == 0 && (frame & (ANALOG_IDLE_FRAMES - 1)) == 0;
+}
+
+// Select a multiplexer pin.
+static void analog_select (uint8_t mux)
+{
+	SELECT_MULTIPLEXER_PIN(mux);
+	analog_mux = mux;
+}
+
+// Select the pin of the next entry after the current one that is wanted,
+// so it can settle while the current conversion finishes.
+static void analog_select_next (void)
+{
+	uint8_t pass = analog_pass;
+	uint8_t index = analog_index;
+	uint8_t frame = analog_frame;
+	do {
+		if (analog_advance(&pass, &index)) ++frame;
+	} while (!analog_wanted(frame, pass, index));
+
+	uint8_t mux = analog_slot(pass, index) >> 2;
+	if (mux != analog_mux) analog_select(mux);
+}
+
+// Measure the noise floor of each enabled pot, which should be at rest,
+// and pick the least smoothing and the narrowest dead band that keep it
+// steady. Pots on disabled ADC channels get the defaults. The scan list is
+// compiled from the channel map first, so this also works before
+// analog_setup(), from the self test. This blocks for a few milliseconds,
+// and the filters start again from the next sample, with each pot's
+// adc_value[] at the mean reading measured.
+void analog_measure_noise ()
+{
+	analog_compile_map();
+	DDRD |= MULTIPLEXER_PINS;
+	for (uint8_t i=0; i < NUM_ANALOG; ++i) {
+		analog_noise_t* pot = &analog_floor[i];
+		adc_value[i] = 0;
+		pot->spread = 0;
+		pot->band = ANALOG_BAND_MIN;
+		pot->smoothing = ANALOG_FILTER_SHIFT;
+		if (i >= analog_pots) continue;
+		uint8_t slot = analog_pot[i] & ANALOG_SLOT_MASK;
+		uint8_t channel = slot & 0x03;
+		if (!(g_exp_analog_read & (1 << channel))) continue;
+		analog_select(slot >> 2);
+
+		// The first reading lets the multiplexer settle.
+		adc_read(channel);
+		uint16_t sum = 0;
+		uint16_t min = 0xffff;
+		uint16_t max = 0;
+		for (uint8_t n=0; n < ANALOG_NOISE_SAMPLES; ++n) {
+			uint16_t value = adc_read(channel);
+			sum += value;
+			if (value < min) min = value;
+			if (value > max) max = value;
+		}
+		uint16_t spread = max - min;
+		adc_value[i] = (sum + ANALOG_NOISE_SAMPLES/2) / ANALOG_NOISE_SAMPLES;
+		pot->spread = (spread > 0xff) ? 0xff : spread;
+
+		uint8_t smoothing = 1;
+		if (spread <= ANALOG_QUIET_SPREAD) smoothing = 0;
+		if (spread > ANALOG_NOISY_SPREAD) smoothing = ANALOG_FILTER_SHIFT;
+		if (smoothing > ANALOG_FILTER_SHIFT) smoothing = ANALOG_FILTER_SHIFT;
+		uint16_t band = (spread >> smoothing) + 1;
+		pot->smoothing = smoothing;
+		pot->band = (band > ANALOG_BAND_MAX) ? ANALOG_BAND_MAX : band;
+	}
+	analog_changes = 0xff;
+	analog_primed = false;
+}
+
+// The noise floor measured for pot i.
+const analog_noise_t* analog_noise_floor (uint8_t i)
+{
+	return &analog_floor[i];
+}
+
+// Do the next few conversions of the analog scan. Returns true when a frame
+// has been completed, with the filtered pots in adc_value[] and the buttons
+// decoded into g_button_state. If the ADC runs out of bus time the
+// scan simply carries on from where it was on the next call. Conversions
+// that aren't wanted are skipped without touching the bus, and the buttons
+// only need the short form of each conversion. Once a frame is done this
+// returns at once until the next one is due, ANALOG_FRAME_MS after it.
+bool analog_poll ()
+{
+	if (analog_unsaved) analog_save_range(false);
+	if (!analog_pots && !analog_buttons) return false;
+
+	// Wait for the next frame to be due. A scan that has fallen a whole
+	// frame behind starts again from now instead of trying to catch up.
+	if (analog_waiting) {
+		uint8_t now = (uint8_t)g_key_ticks;
+		uint8_t elapsed = now - analog_tick;
+		if (elapsed < ANALOG_FRAME_MS) return false;
+		analog_tick = (elapsed < 2*ANALOG_FRAME_MS) ? analog_tick + ANALOG_FRAME_MS : now;
+		analog_waiting = false;
+	}
+
+	uint8_t n = 0;
+	while (n < ANALOG_CONVERSIONS_PER_POLL) {
+		uint8_t pass = analog_pass;
+		uint8_t index = analog_index;
+
+		if (analog_wanted(analog_frame, pass, index)) {
+			uint8_t slot = analog_slot(pass, index);
+			uint8_t mux = slot >> 2;
+			uint8_t channel = slot & 0x03;
+
+			// The multiplexer pins are driven from the first scan on, and
+			// again if anything has turned them back into inputs since.
+			// If a pot started moving after the scan looked ahead its pin
+			// won't have been selected, so select it now.
+			if ((DDRD & MULTIPLEXER_PINS) != MULTIPLEXER_PINS) {
+				DDRD |= MULTIPLEXER_PINS;
+				analog_select(mux);
+			} else if (analog_mux != mux) {
+				analog_select(mux);
+			}
+
+			if (!adc_try_start(channel)) {
+				return false;
+			}
+			analog_select_next();
+			++n;
+
+			if (pass < ANALOG_SAMPLES) {
+				analog_filter_sample(index, adc_finish());
+			} else {
+				// Buttons are decoded four at a time. The missing buttons
+				// of a short last group read as released.
+				uint8_t position = index & 0x03;
+				analog_button_levels |= (uint16_t)adc_finish_short() << (position << 2);
+				if (position == 3 || index == analog_buttons - 1) {
+					while (++position < 4) {
+						analog_button_levels |= (uint16_t)0x0f << (position << 2);
+					}
+					buttons_sample(index >> 2, analog_button_levels);
+					analog_button_levels = 0;
+				}
+			}
+		}
+
+		if (analog_advance(&analog_pass, &analog_index)) {
+			// Filter and publish the pots, and wait for the next frame
+			for (uint8_t i=0; i < analog_pots; ++i) {
+				analog_filter_frame(i);
+				analog_hysteresis(i);
+				if (analog_calibrating) {
+					uint8_t value = analog_filter[i] >> 6;
+					if (value < analog_range[i].seen.min) analog_range[i].seen.min = value;
+					if (value > analog_range[i].seen.max) analog_range[i].seen.max = value;
+				}
+			}
+			if (analog_buttons) buttons_frame();
+			analog_primed = true;
+			analog_sample_all = analog_calibrating;
+			analog_waiting = true;
+			++analog_frame;
+			return true;
+		}
+	}
+	return false;
+}
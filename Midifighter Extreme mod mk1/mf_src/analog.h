@@ -0,0 +1,110 @@
+// Background acquisition of the Midifighter Extreme mod's analog inputs.
+//
+// The pots and analog buttons sit behind an 8-way multiplexer on each of
+// the four ADC channels. Rather than scanning them all in one go, the
+// scan is spread over many passes of the main loop, a few conversions at a
+// time, so the keys never wait on the analog inputs.
+
+#ifndef _ANALOG_H_INCLUDED
+#define _ANALOG_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Configuration
+
+// A frame is started on the millisecond timer tick every ANALOG_FRAME_MS,
+// so the inputs are sampled and the pots published at a fixed rate however
+// busy the main loop is. A frame that overruns its slot delays the next.
+#define ANALOG_FRAME_MS 2
+
+// Most samples of each pot taken per frame. The samples a pot gets in a
+// frame are averaged into one value, decimating them to the frame rate.
+#define ANALOG_SAMPLES 4
+
+// Each pot's value is then smoothed by an exponential filter with a time
+// constant of ANALOG_FRAME_MS << N, N being the pot's smoothing, and a
+// moving pot gets 2^N samples a frame. The filter runs on 10-bit values
+// with 4 fractional bits. ANALOG_FILTER_MS is the longest time constant,
+// used for the noisiest pots and those that haven't been measured, and
+// sets the largest smoothing, ANALOG_FILTER_SHIFT (at most 2).
+#define ANALOG_FILTER_MS 8
+#define ANALOG_FILTER_SHIFT ((ANALOG_FILTER_MS >= 2*ANALOG_FRAME_MS) + \
+                             (ANALOG_FILTER_MS >= 4*ANALOG_FRAME_MS))
+
+// The filter also tracks how far values stray from it, as a measure of the
+// pot's noise, moving 1/2^N of the way each frame.
+#define ANALOG_NOISE_SHIFT 4
+
+// A pot only reports a new value once it has moved further than its dead
+// band from the last reported value. At rest the band is twice the noise,
+// clamped between the pot's measured band and ANALOG_BAND_MAX (in 10-bit
+// units). For ANALOG_MOVING_MS after a report the pot counts as moving and
+// the band drops to the measured band so slow sweeps track finely.
+// ANALOG_BAND_MIN is the band of pots that haven't been measured.
+#define ANALOG_BAND_MIN      2
+#define ANALOG_BAND_MAX      12
+#define ANALOG_MOVING_MS     64
+#define ANALOG_MOVING_FRAMES (ANALOG_MOVING_MS / ANALOG_FRAME_MS)
+
+// Pots that aren't moving are only sampled once every ANALOG_IDLE_MS, in
+// the first pass of a frame, until they move again. ANALOG_IDLE_FRAMES
+// must come out a power of two. The buttons are read every frame.
+#define ANALOG_IDLE_MS     16
+#define ANALOG_IDLE_FRAMES (ANALOG_IDLE_MS / ANALOG_FRAME_MS)
+
+// Most ADC conversions done by one call to analog_poll(). Each one is about
+// 30us of bus time.
+#define ANALOG_CONVERSIONS_PER_POLL 4
+
+// The channel map. Each of the four ADC channels on each multiplexer pin
+// is a slot, described in the EEPROM as a pot, a button or unused with two
+// bits per slot and a byte per pin.
+#define ANALOG_MUX_PINS 8
+#define ANALOG_UNUSED   0
+#define ANALOG_POT      1
+#define ANALOG_BUTTON   2
+
+// Calibration. Each pot maps the range between its calibrated min and max
+// onto 0..127. While calibrating the extremes each pot reaches are
+// recorded, and when calibration finishes any pot whose range is at least
+// ANALOG_CAL_MIN_SPAN wide (in 10-bit units) takes it, pulled in by
+// ANALOG_CAL_MARGIN at each end so noise can't keep it off 0 or 127.
+#define ANALOG_CAL_MIN_SPAN 256
+#define ANALOG_CAL_MARGIN   4
+
+// Noise floor measurement. Each enabled pot is read ANALOG_NOISE_SAMPLES
+// times at rest. Pots with a peak-to-peak spread up to ANALOG_QUIET_SPREAD
+// get no smoothing, those above ANALOG_NOISY_SPREAD the most, and the rest
+// half of it. The band is the spread left after smoothing, plus one. A
+// spread of ANALOG_BROKEN_SPREAD or more fails the self test.
+#define ANALOG_NOISE_SAMPLES 32
+#define ANALOG_QUIET_SPREAD  1
+#define ANALOG_NOISY_SPREAD  4
+#define ANALOG_BROKEN_SPREAD 128
+
+// Types
+
+// The measured noise floor of a pot, and the filtering chosen for it. The
+// mean reading is where the pot's adc_value[] starts from.
+typedef struct {
+	uint8_t spread;         // peak-to-peak noise, 10-bit units
+	uint8_t band : 4;       // dead band, 10-bit units
+	uint8_t smoothing : 4;  // filter shift, 2^smoothing samples per frame
+} analog_noise_t;
+
+// Functions
+
+void analog_setup (void);
+void analog_set_slot (uint8_t slot, uint8_t kind);
+bool analog_poll (void);
+uint8_t analog_position (uint8_t i, uint16_t value);
+uint8_t analog_shaped (uint8_t i, uint16_t value);
+uint8_t analog_take_changes (void);
+void analog_set_curve (uint8_t i, uint8_t curve);
+void analog_calibrate_start (void);
+void analog_calibrate_finish (void);
+void analog_measure_noise (void);
+const analog_noise_t* analog_noise_floor (uint8_t i);
+
+#endif
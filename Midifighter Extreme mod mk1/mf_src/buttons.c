@@ -0,0 +1,72 @@
+// Debounced decoder for the Midifighter Extreme mod's analog buttons.
+
+#include "buttons.h"
+
+uint32_t g_button_state = 0;
+
+// The debounce count of each button in bits 4-6 and its learned idle level
+// in bits 0-3.
+#define BUTTON_COUNT_SHIFT 4
+#define BUTTON_IDLE_MASK   0x0f
+static uint8_t button_info[NUM_ANALOG_BUTTONS];
+
+// Frames left in which the idle levels are being learned.
+static uint8_t button_learning = BUTTON_LEARN_FRAMES;
+
+// Run one reading through a button's counter.
+static void button_update (uint8_t i, uint8_t level)
+{
+	uint8_t info = button_info[i];
+	uint8_t idle = info & BUTTON_IDLE_MASK;
+	uint8_t count = info >> BUTTON_COUNT_SHIFT;
+
+	uint8_t press = BUTTON_PRESS_LEVEL;
+	uint8_t release = BUTTON_RELEASE_LEVEL;
+	if (idle >= BUTTON_MIN_IDLE) {
+		press = idle >> 2;
+		release = idle >> 1;
+	}
+
+	if (level < press) {
+		if (count < BUTTON_DEBOUNCE) ++count;
+	} else if (level >= release) {
+		if (count > 0) --count;
+	}
+	button_info[i] = (count << BUTTON_COUNT_SHIFT) | idle;
+
+	if (count == BUTTON_DEBOUNCE) {
+		g_button_state |= BUTTON(i);
+	} else if (count == 0) {
+		g_button_state &= ~BUTTON(i);
+	}
+}
+
+// Take the readings of one group of four buttons, packed four bits per
+// button with the button on ADC channel 0 lowest.
+void buttons_sample (uint8_t group, uint16_t levels)
+{
+	uint8_t first = group << 2;
+
+	if (button_learning) {
+		// Learn the highest level each button idles at.
+		for (uint8_t i=first; i < first + 4; ++i) {
+			uint8_t level = levels & BUTTON_IDLE_MASK;
+			if (level > button_info[i]) button_info[i] = level;
+			levels >>= 4;
+		}
+		return;
+	}
+
+	for (uint8_t i=first; i < first + 4; ++i) {
+		button_update(i, levels & BUTTON_IDLE_MASK);
+		levels >>= 4;
+	}
+}
+
+// Count a frame, after every group in the scan has been read. The idle
+// levels are learned over the first BUTTON_LEARN_FRAMES frames, however
+// many groups the channel map has.
+void buttons_frame (void)
+{
+	if (button_learning) --button_learning;
+}
@@ -0,0 +1,45 @@
+// Debounced decoder for the Midifighter Extreme mod's analog buttons.
+//
+// Each button pulls its multiplexer input down towards ground when pressed.
+// Only the top four bits of each reading are used. Readings are integrated
+// by a per-button counter, so a button has to read pressed or released
+// several times running before it changes state, and the thresholds are
+// learned from the level each button idles at during boot.
+
+#ifndef _BUTTONS_H_INCLUDED
+#define _BUTTONS_H_INCLUDED
+
+#include <stdint.h>
+
+#include "mod.h"
+
+// Configuration
+
+// Readings in a row a button must agree on before it changes state (1..7)
+#define BUTTON_DEBOUNCE 3
+
+// Frames read at boot to learn the idle level of each button
+#define BUTTON_LEARN_FRAMES 8
+
+// A button reads pressed below a quarter of its idle level and released
+// from half of it. A button idling below BUTTON_MIN_IDLE (e.g. because it
+// was held down during boot) uses BUTTON_PRESS_LEVEL and
+// BUTTON_RELEASE_LEVEL instead. Levels are the top four bits of the ADC.
+#define BUTTON_MIN_IDLE      4
+#define BUTTON_PRESS_LEVEL   1
+#define BUTTON_RELEASE_LEVEL 4
+
+// The bit of button i in g_button_state
+#define BUTTON(i) ((uint32_t)1 << (i))
+
+// Globals
+
+// Debounced state of every button, one bit each, set while pressed
+extern uint32_t g_button_state;
+
+// Functions
+
+void buttons_sample (uint8_t group, uint16_t levels);
+void buttons_frame (void);
+
+#endif
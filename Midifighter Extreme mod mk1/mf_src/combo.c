@@ -6,10 +6,14 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 
 #include "key.h"
+#include "led.h"
+#include "eeprom.h"
 #include "combo.h"
+#include "constants.h"
 
 // COMBOS
 //
@@ -23,7 +27,29 @@
 //                                     a-b-c-c-d   uuddlrlrBA
 //
 // Combos retain a NoteOn while the final key is depressed and emit a NoteUp
-// when it is released.
+// when it is released. The preset and menu combos just fire once.
+//
+// These are the built-in combos. A table of up to COMBO_MAX_RULES rules in
+// the same format can be uploaded to the EEPROM over SysEx, and is used in
+// their place if it passes validation when it is loaded.
+//
+// The recognizer follows every combo at once. When the rules are loaded
+// they are compiled into bitsets with one bit per state: the key test that
+// enters each state, the states entered straight from state 0 and the
+// states that fire an action. Each combo is a chain of states N, N+1, ...
+// so on every key event all partial matches advance together with a shift
+// and a few ANDs, however many combos there are, and a combo that shares a
+// prefix with another is picked up without any cross-links between them.
+// Rules that don't move from state 0 or N to N+1 (the old "--> combo C"
+// cross-links and the release rules) are left out.
+//
+// A sequence times out if a step comes more than COMBO_STEP_MS after the
+// last one. Nothing polls for this: the time of the last step is checked
+// when the next key event arrives, and all partial matches dropped at once.
+//
+// Chords are rules with a KEYCHORD test. All the KEYCHORD rules with the
+// same action make up one chord, which fires when exactly its keys are
+// held and all went down within COMBO_CHORD_MS, in any order.
 
 
 // Types ----------------------------------------------------------------------
@@ -35,30 +61,42 @@ typedef struct combo_state {
     combo_action_t action;     // action on this transition
 } combo_state_t;
 
+// Chords are timed from the start of the keys' hold.
+typedef char combo_chord_time_check
+    [(COMBO_CHORD_MS <= KEY_HOLD_AGE_MAX) ? 1 : -1];
+
 
 // Globals ---------------------------------------------------------------------
 
-// Top two bits of the key index tell us which keystate to test.
-#define KEYMASK  0xF0
-#define KEYDOWN  0x10
-#define KEYUP    0x20
-
-// count and list of active states.
-static uint8_t combo_state;
-
-// State Offset Table
-// records for state N starts at offset M in the state table.
-uint8_t state_offset[] PROGMEM = {
-    0,
-    4, 5, 6, 7,
-    8, 9, 10, 11,
-    12, 13, 14,
-    16, 17, 18, 19, 20, 21,
-    22, 23, 24, 25, 26, 27, 28, 29, 30,
-    32, 33, 34, 35, 36,
-    38, 39,
-    41, 42, 43
-};
+// A set of states, one bit per state, just big enough for COMBO_MAX_STATES.
+// The set of states in a partial match. State 0 is always active.
+#define COMBO_SET_BYTES ((COMBO_MAX_STATES + 7) / 8)
+typedef uint8_t combo_states_t[COMBO_SET_BYTES];
+static combo_states_t combo_active;
+
+// Where the rules are read from, the EEPROM or the built-in table, and how
+// many there are.
+static bool combo_from_eeprom = false;
+static uint8_t combo_num_rules = 0;
+
+// The compiled rules. Each state's entry test as one set for each of the
+// low six bits of the rule's key: four for the key number and two for the
+// keystate test, with a keystate test stored as 11 so that a state with no
+// entry test (00) never matches. Then the states entered from state 0 and
+// the states that fire an action.
+#define COMBO_TEST_BITS 6
+#define COMBO_TEST_HELD 0x30
+static combo_states_t combo_test_key[COMBO_TEST_BITS];
+static combo_states_t combo_start;
+static combo_states_t combo_final;
+
+// When the partial matches last advanced.
+static uint16_t combo_step_tick;
+
+// The compiled chords, the keys of each and the action it fires.
+static uint16_t combo_chord_keys[COMBO_MAX_CHORDS];
+static combo_action_t combo_chord_action[COMBO_MAX_CHORDS];
+static uint8_t combo_num_chords;
 
 // State Transition Table
 // Key numbers are:
@@ -72,53 +110,66 @@ uint8_t state_offset[] PROGMEM = {
 combo_state_t state_table[] PROGMEM = {
 //          state  key           next action
 /*  0 */   {  0,   12 | KEYDOWN,   1,  COMBO_NONE },  // combo A
-/*  1 */   {  0,    9 | KEYDOWN,   5,  COMBO_NONE },  // combo B
+/*  1 */   {  0,    9 | KEYDOWN,   5,  COMBO_NONE },  // combo C
 /*  2 */   {  0,    8 | KEYDOWN,   9,  COMBO_NONE },  // combo D
 /*  3 */   {  0,    4 | KEYDOWN,  18,  COMBO_NONE },  // combo E
-
-/*  4 */   {  1,   13 | KEYDOWN,   2,  COMBO_NONE },  // combo A
-/*  5 */   {  2,   14 | KEYDOWN,   3,  COMBO_NONE },
-/*  6 */   {  3,   15 | KEYDOWN,   4,  COMBO_A_DOWN },
-/*  7 */   {  4,   15 | KEYUP,     0,  COMBO_A_RELEASE },
-
-/*  8 */   {  5,   10 | KEYDOWN,   6,  COMBO_NONE }, // combo B
-/*  9 */   {  6,    5 | KEYDOWN,   7,  COMBO_NONE },
-/* 10 */   {  7,    6 | KEYDOWN,   8,  COMBO_C_DOWN },
-/* 11 */   {  8,    6 | KEYUP,     0,  COMBO_C_RELEASE },
-
-/* 12 */   {  9,    8 | KEYUP,    10,  COMBO_NONE },  // combo D
-/* 13 */   { 10,    9 | KEYDOWN,  11,  COMBO_NONE },
-/* 14 */   { 11,    9 | KEYUP,    12,  COMBO_NONE },
-/* 15 */   { 11,   10 | KEYDOWN,   6,  COMBO_NONE }, // --> combo C
-/* 16 */   { 12,   10 | KEYDOWN,  13,  COMBO_NONE },
-/* 17 */   { 13,   10 | KEYUP,    14,  COMBO_NONE },
-/* 18 */   { 14,   10 | KEYDOWN,  15,  COMBO_NONE },
-/* 19 */   { 15,   10 | KEYUP,    16,  COMBO_NONE },
-/* 20 */   { 16,   11 | KEYDOWN,  17,  COMBO_D_DOWN },
-/* 21 */   { 17,   11 | KEYUP,     0,  COMBO_D_RELEASE },
-
-/* 22 */   { 18,    4 | KEYUP,    19, COMBO_NONE }, // combo E
-/* 23 */   { 19,    4 | KEYDOWN,  20, COMBO_NONE },
-/* 24 */   { 20,    4 | KEYUP,    21, COMBO_NONE },
-/* 25 */   { 21,   12 | KEYDOWN,  22, COMBO_NONE },
-/* 26 */   { 22,   12 | KEYUP,    23, COMBO_NONE },
-/* 27 */   { 23,   12 | KEYDOWN,  24, COMBO_NONE },
-/* 28 */   { 24,   12 | KEYUP,    25, COMBO_NONE },
-/* 29 */   { 25,    8 | KEYDOWN,  26, COMBO_NONE },
-/* 30 */   { 26,    8 | KEYUP,    27, COMBO_NONE },
-/* 31 */   { 26,   10 | KEYDOWN,   6, COMBO_NONE }, // --> combo C
-/* 32 */   { 27,    9 | KEYDOWN,  28, COMBO_NONE },
-/* 33 */   { 28,    9 | KEYUP,    29, COMBO_NONE },
-/* 34 */   { 29,    8 | KEYDOWN,  30, COMBO_NONE },
-/* 35 */   { 30,    8 | KEYUP,    31, COMBO_NONE },
-/* 36 */   { 31,    9 | KEYDOWN,  32, COMBO_NONE },
-/* 37 */   { 31,   10 | KEYDOWN,  13, COMBO_NONE }, // --> combo D
-/* 38 */   { 32,    9 | KEYUP,    33, COMBO_NONE },
-/* 39 */   { 33,   11 | KEYDOWN,  34, COMBO_NONE },
-/* 40 */   { 33,    9 | KEYDOWN,  11, COMBO_NONE }, // --> combo D
-/* 41 */   { 34,   11 | KEYUP,    35, COMBO_NONE },
-/* 42 */   { 35,   10 | KEYDOWN,  36, COMBO_E_DOWN },
-/* 43 */   { 36,   10 | KEYUP,     0, COMBO_E_RELEASE },
+/*  4 */   {  0,    8 | KEYCHORD,  0,  COMBO_B_DOWN },  // combo B
+/*  5 */   {  0,    9 | KEYCHORD,  0,  COMBO_B_DOWN },
+/*  6 */   {  0,   10 | KEYCHORD,  0,  COMBO_B_DOWN },
+/*  7 */   {  0,   11 | KEYCHORD,  0,  COMBO_B_DOWN },
+/*  8 */   {  0,    0 | KEYCHORD,  0,  COMBO_PRESET_NEXT },  // next preset
+/*  9 */   {  0,    3 | KEYCHORD,  0,  COMBO_PRESET_NEXT },
+/* 10 */   {  0,   12 | KEYCHORD,  0,  COMBO_PRESET_NEXT },
+/* 11 */   {  0,   15 | KEYCHORD,  0,  COMBO_PRESET_NEXT },
+
+/* 12 */   {  0,    0 | KEYCHORD,  0,  COMBO_MENU },  // settings menu
+/* 13 */   {  0,    5 | KEYCHORD,  0,  COMBO_MENU },
+/* 14 */   {  0,   10 | KEYCHORD,  0,  COMBO_MENU },
+/* 15 */   {  0,   15 | KEYCHORD,  0,  COMBO_MENU },
+
+/* 16 */   {  1,   13 | KEYDOWN,   2,  COMBO_NONE },  // combo A
+/* 17 */   {  2,   14 | KEYDOWN,   3,  COMBO_NONE },
+/* 18 */   {  3,   15 | KEYDOWN,   4,  COMBO_A_DOWN },
+/* 19 */   {  4,   15 | KEYUP,     0,  COMBO_A_RELEASE },
+
+/* 20 */   {  5,   10 | KEYDOWN,   6,  COMBO_NONE }, // combo C
+/* 21 */   {  6,    5 | KEYDOWN,   7,  COMBO_NONE },
+/* 22 */   {  7,    6 | KEYDOWN,   8,  COMBO_C_DOWN },
+/* 23 */   {  8,    6 | KEYUP,     0,  COMBO_C_RELEASE },
+
+/* 24 */   {  9,    8 | KEYUP,    10,  COMBO_NONE },  // combo D
+/* 25 */   { 10,    9 | KEYDOWN,  11,  COMBO_NONE },
+/* 26 */   { 11,    9 | KEYUP,    12,  COMBO_NONE },
+/* 27 */   { 11,   10 | KEYDOWN,   6,  COMBO_NONE }, // --> combo C
+/* 28 */   { 12,   10 | KEYDOWN,  13,  COMBO_NONE },
+/* 29 */   { 13,   10 | KEYUP,    14,  COMBO_NONE },
+/* 30 */   { 14,   10 | KEYDOWN,  15,  COMBO_NONE },
+/* 31 */   { 15,   10 | KEYUP,    16,  COMBO_NONE },
+/* 32 */   { 16,   11 | KEYDOWN,  17,  COMBO_D_DOWN },
+/* 33 */   { 17,   11 | KEYUP,     0,  COMBO_D_RELEASE },
+
+/* 34 */   { 18,    4 | KEYUP,    19, COMBO_NONE }, // combo E
+/* 35 */   { 19,    4 | KEYDOWN,  20, COMBO_NONE },
+/* 36 */   { 20,    4 | KEYUP,    21, COMBO_NONE },
+/* 37 */   { 21,   12 | KEYDOWN,  22, COMBO_NONE },
+/* 38 */   { 22,   12 | KEYUP,    23, COMBO_NONE },
+/* 39 */   { 23,   12 | KEYDOWN,  24, COMBO_NONE },
+/* 40 */   { 24,   12 | KEYUP,    25, COMBO_NONE },
+/* 41 */   { 25,    8 | KEYDOWN,  26, COMBO_NONE },
+/* 42 */   { 26,    8 | KEYUP,    27, COMBO_NONE },
+/* 43 */   { 26,   10 | KEYDOWN,   6, COMBO_NONE }, // --> combo C
+/* 44 */   { 27,    9 | KEYDOWN,  28, COMBO_NONE },
+/* 45 */   { 28,    9 | KEYUP,    29, COMBO_NONE },
+/* 46 */   { 29,    8 | KEYDOWN,  30, COMBO_NONE },
+/* 47 */   { 30,    8 | KEYUP,    31, COMBO_NONE },
+/* 48 */   { 31,    9 | KEYDOWN,  32, COMBO_NONE },
+/* 49 */   { 31,   10 | KEYDOWN,  13, COMBO_NONE }, // --> combo D
+/* 50 */   { 32,    9 | KEYUP,    33, COMBO_NONE },
+/* 51 */   { 33,   11 | KEYDOWN,  34, COMBO_NONE },
+/* 52 */   { 33,    9 | KEYDOWN,  11, COMBO_NONE }, // --> combo D
+/* 53 */   { 34,   11 | KEYUP,    35, COMBO_NONE },
+/* 54 */   { 35,   10 | KEYDOWN,  36, COMBO_E_DOWN },
+/* 55 */   { 36,   10 | KEYUP,     0, COMBO_E_RELEASE },
 
 };
 
@@ -135,17 +186,255 @@ uint16_t rightmost_bit_16(uint16_t value)
     return bit;
 }
 
+// Read rule "index" from wherever the rules are loaded from.
+//
+static void combo_read_rule(uint8_t index, combo_state_t* rule)
+{
+    if (combo_from_eeprom) {
+        // The rule is stored as the four bytes of a combo_state_t.
+        eeprom_read_bytes(rule, EE_COMBO_RULES + index * COMBO_RULE_SIZE,
+                          COMBO_RULE_SIZE);
+    } else {
+        memcpy_P(rule, &state_table[index], sizeof(combo_state_t));
+    }
+}
+
+// Check the uploaded rules in the EEPROM. The rules must be sorted by
+// state, every state must be below COMBO_MAX_STATES, every key test must
+// be a keydown, keyup, keystate or chord test and every action must exist.
+//
+static bool combo_validate(uint8_t num_rules)
+{
+    if (num_rules == 0 || num_rules > COMBO_MAX_RULES) {
+        return false;
+    }
+    uint8_t prev_state = 0;
+    for (uint8_t i=0; i<num_rules; ++i) {
+        combo_state_t rule;
+        combo_read_rule(i, &rule);
+        uint8_t keytest = rule.key & KEYMASK;
+        if (rule.state_num < prev_state ||
+            rule.state_num >= COMBO_MAX_STATES ||
+            rule.next_state >= COMBO_MAX_STATES ||
+            (keytest != 0 && keytest != KEYDOWN && keytest != KEYUP &&
+             keytest != KEYCHORD) ||
+            rule.action > COMBO_MENU) {
+            return false;
+        }
+        prev_state = rule.state_num;
+    }
+    return true;
+}
+
+// Add "state" to a set, or test whether it is in one.
+//
+static void combo_set_add(combo_states_t set, uint8_t state)
+{
+    set[state >> 3] |= 1 << (state & 7);
+}
+
+static bool combo_set_has(const combo_states_t set, uint8_t state)
+{
+    return set[state >> 3] & (1 << (state & 7));
+}
+
+// The entry test of "state" in the rule format, a key number and which
+// keystate to test.
+//
+static uint8_t combo_entry_test(uint8_t state)
+{
+    uint8_t key = 0;
+    for (uint8_t bit=0; bit<COMBO_TEST_BITS; ++bit) {
+        if (combo_set_has(combo_test_key[bit], state)) {
+            key |= 1 << bit;
+        }
+    }
+    if ((key & KEYMASK) == COMBO_TEST_HELD) {
+        key &= ~KEYMASK;
+    }
+    return key;
+}
+
+// Compile the rules into the state sets. Returns false if a state can be
+// entered by two different key tests, which the sets can't represent.
+//
+static bool combo_compile(void)
+{
+    memset(combo_test_key, 0, sizeof(combo_test_key));
+    memset(combo_start, 0, sizeof(combo_start));
+    memset(combo_final, 0, sizeof(combo_final));
+    combo_num_chords = 0;
+
+    for (uint8_t i=0; i<combo_num_rules; ++i) {
+        combo_state_t rule;
+        combo_read_rule(i, &rule);
+
+        // Add a chord key to the chord with the same action.
+        if ((rule.key & KEYMASK) == KEYCHORD) {
+            if (!COMBO_FIRES(rule.action)) {
+                return false;
+            }
+            uint8_t chord = 0;
+            while (chord < combo_num_chords && combo_chord_action[chord] != rule.action) {
+                ++chord;
+            }
+            if (chord == combo_num_chords) {
+                if (chord == COMBO_MAX_CHORDS) {
+                    return false;
+                }
+                combo_chord_keys[chord] = 0;
+                combo_chord_action[chord] = rule.action;
+                ++combo_num_chords;
+            }
+            combo_chord_keys[chord] |= 1 << (rule.key & 0x0f);
+            continue;
+        }
+
+        uint8_t next = rule.next_state;
+        if (next == 0 || (rule.state_num != 0 && rule.state_num != next - 1)) {
+            continue;
+        }
+
+        // A state that already has an entry test must keep the same one.
+        // Every entry test sets at least one of the two keystate bits.
+        if (combo_set_has(combo_test_key[4], next) ||
+            combo_set_has(combo_test_key[5], next)) {
+            if (combo_entry_test(next) != rule.key) {
+                return false;
+            }
+        } else {
+            uint8_t key = rule.key;
+            if ((key & KEYMASK) == 0) {
+                key |= COMBO_TEST_HELD;
+            }
+            for (uint8_t bit=0; bit<COMBO_TEST_BITS; ++bit) {
+                if (key & (1 << bit)) {
+                    combo_set_add(combo_test_key[bit], next);
+                }
+            }
+        }
+
+        if (rule.state_num == 0) {
+            combo_set_add(combo_start, next);
+        }
+        if (COMBO_FIRES(rule.action)) {
+            combo_set_add(combo_final, next);
+        }
+    }
+    return true;
+}
+
+// Load the rules, from the EEPROM if a valid table has been uploaded and
+// from the built-in table otherwise, and compile them. Returns true if the
+// uploaded table was taken.
+//
+bool combo_load(void)
+{
+    combo_from_eeprom = true;
+    combo_num_rules = eeprom_read(EE_COMBO_COUNT);
+    if (!combo_validate(combo_num_rules) || !combo_compile()) {
+        combo_from_eeprom = false;
+        combo_num_rules = sizeof(state_table) / sizeof(combo_state_t);
+        if (!combo_compile()) {
+            // The built-in table itself is broken, which is a firmware bug.
+            // Stop here with every LED in the middle rows lit rather than
+            // run with half the combos silently missing.
+            led_set_state(0x0ff0);
+            while(1);
+        }
+    }
+
+    combo_setup();
+    return combo_from_eeprom;
+}
+
+// Store one byte of an uploaded table, "offset" bytes into the rules. The
+// table isn't used until it has been committed with combo_commit().
+//
+void combo_write_byte(uint16_t offset, uint8_t byte)
+{
+    if (offset >= COMBO_MAX_RULES * COMBO_RULE_SIZE) return;
+    eeprom_write(EE_COMBO_RULES + offset, byte);
+}
+
+// Set the number of rules in the uploaded table and load it, or go back to
+// the built-in combos if "num_rules" is zero. Returns false if the table
+// failed validation, in which case the built-in combos are used.
+//
+bool combo_commit(uint8_t num_rules)
+{
+    eeprom_write(EE_COMBO_COUNT, num_rules);
+    return combo_load() || num_rules == 0;
+}
+
 void combo_setup(void)
 {
     // init the state machine at state 0.
-    combo_state = 0;
+    memset(combo_active, 0, sizeof(combo_active));
+}
+
+// Advance the partial matches on this key event. A state is entered if its
+// entry test passes and it follows an active state, or state 0. The sets
+// are worked through a byte at a time, carrying the shift between bytes.
+//
+static void combo_advance(const uint16_t keydown,
+                          const uint16_t keyup,
+                          const uint16_t keystate)
+{
+    uint8_t carry = 0;
+    for (uint8_t i=0; i<COMBO_SET_BYTES; ++i) {
+        uint8_t follow = (combo_active[i] << 1) | carry | combo_start[i];
+        carry = combo_active[i] >> 7;
+
+        // The states in this byte whose entry test is passed by a key.
+        uint8_t down = combo_test_key[4][i] & ~combo_test_key[5][i];
+        uint8_t up = combo_test_key[5][i] & ~combo_test_key[4][i];
+        uint8_t held = combo_test_key[4][i] & combo_test_key[5][i];
+        uint8_t match = 0;
+        uint16_t keys = keydown | keyup | keystate;
+        for (uint8_t keynum=0; keys; ++keynum, keys >>= 1) {
+            if (!(keys & 1)) {
+                continue;
+            }
+            uint16_t keybit = 1 << keynum;
+            uint8_t test = 0;
+            if (keydown & keybit) test |= down;
+            if (keyup & keybit) test |= up;
+            if (keystate & keybit) test |= held;
+
+            // Keep the states that test this key number.
+            for (uint8_t bit=0; bit<4; ++bit) {
+                if (keynum & (1 << bit)) {
+                    test &= combo_test_key[bit][i];
+                } else {
+                    test &= ~combo_test_key[bit][i];
+                }
+            }
+            match |= test;
+        }
+        combo_active[i] = match & follow;
+    }
+}
+
+// The action fired on entering "state", found from the rules. Only done
+// when a combo completes.
+//
+static combo_action_t combo_state_action(uint8_t state)
+{
+    for (uint8_t i=0; i<combo_num_rules; ++i) {
+        combo_state_t rule;
+        combo_read_rule(i, &rule);
+        if (rule.next_state == state && rule.action != COMBO_NONE) {
+            return rule.action;
+        }
+    }
+    return COMBO_NONE;
 }
 
 combo_action_t combo_recognize(const uint16_t keydown,
                                const uint16_t keyup,
                                const uint16_t keystate)
 {
-    uint8_t combo_next_state = 0;
     static combo_action_t combo_action = COMBO_NONE;
     static uint16_t combo_release_key = 0;
 
@@ -154,29 +443,12 @@ combo_action_t combo_recognize(const uint16_t keydown,
         return COMBO_NONE;
     }
 
-    // Check for ComboB, as the keys can be pressed in any order.
-    if (keystate == 0x0f00 && combo_action != COMBO_B_DOWN) {
-        combo_action = COMBO_B_DOWN;
-        // Record the final key pressed to complete this combo, defined as
-        // the right most bit of the instantaneous keydown bitmask.
-        uint16_t keydown_bit = rightmost_bit_16(keydown);
-        if (keydown_bit == 0) {
-            // the keydown wasn't found inside this mask.
-            // *** THIS SHOULD NEVER HAPPEN ***
-            combo_action = COMBO_NONE;
-        } else {
-            combo_release_key = keydown_bit;
-            combo_action = COMBO_B_DOWN;
-        }
-        return combo_action;
-    }
-
     // If the previous keypress caused a Combo to fire, check for the combo
     // release keyup.
     if (combo_action != COMBO_NONE && combo_action <= COMBO_E_DOWN) {
         if (!(keystate & combo_release_key)) {
             // the release key is unset, reset the state machine to zero.
-            combo_state = 0;
+            combo_setup();
             // emit a keyup event.
             combo_action = combo_action + (COMBO_A_RELEASE - COMBO_A_DOWN);
             return combo_action;
@@ -187,43 +459,54 @@ combo_action_t combo_recognize(const uint16_t keydown,
         }
     }
 
-    // loop over the rules for this state attempting to transition.
-    uint8_t offset = pgm_read_byte(&(state_offset[combo_state]));
-    combo_state_t *rule = state_table + offset;
-    while(pgm_read_byte(&(rule->state_num)) == combo_state) {
-        uint8_t keyrule = pgm_read_byte(&(rule->key));
-
-        // break the keyrule into type of test and bit to test.
-        uint8_t keytest = keyrule & 0xf0;
-        uint8_t keybit = keyrule & 0x0f;
-
-        // setup the key test.
-        uint16_t keymask = 0;
-        if (keytest == KEYDOWN) {
-            keymask = keydown;
-        } else if (keytest == KEYUP) {
-            keymask = keyup;
-        } else {
-            keymask = keystate;
+    // The time of this event, from the timestamp of its keys.
+    uint16_t now = g_key_edge_tick;
+
+    // Check for a chord, the keys of which can be pressed in any order.
+    if (keydown) {
+        for (uint8_t chord=0; chord<combo_num_chords; ++chord) {
+            uint16_t keys = combo_chord_keys[chord];
+            if (keystate != keys || !(keydown & keys)) {
+                continue;
+            }
+            // Every key held is one of the chord's, so they all went down
+            // together if the hold started recently enough.
+            if ((uint16_t)(now - g_key_hold_tick) <= COMBO_CHORD_MS) {
+                // Record the final key pressed to complete this combo,
+                // defined as the right most bit of the keydown bitmask.
+                combo_setup();
+                combo_action = combo_chord_action[chord];
+                combo_release_key = rightmost_bit_16(keydown);
+                return combo_action;
+            }
         }
+    }
+
+    // Drop the partial matches if the sequence has been left too long.
+    if ((uint16_t)(now - combo_step_tick) > COMBO_STEP_MS) {
+        combo_setup();
+    }
 
-        // execute the keytest.
-        if ((1 << keybit) & keymask) {
-            // transition was successful.
-            combo_next_state = pgm_read_byte(&(rule->next_state));
-            combo_action = pgm_read_byte(&(rule->action));
-            // no more rule following.
+    // Advance every partial match at once. Anything that doesn't advance
+    // drops out.
+    combo_advance(keydown, keyup, keystate);
+    combo_step_tick = now;
+
+    // Fire the action of the first combo to complete.
+    combo_action = COMBO_NONE;
+    for (uint8_t i=0; i<COMBO_SET_BYTES; ++i) {
+        uint8_t complete = combo_active[i] & combo_final[i];
+        if (complete) {
+            uint8_t state = i * 8;
+            while (!(complete & 1)) {
+                complete >>= 1;
+                ++state;
+            }
+            combo_action = combo_state_action(state);
             break;
-        } else {
-            // rule failed, reset to zero.
-            combo_next_state = 0;
-            combo_action = COMBO_NONE;
         }
-        rule++;
     }
 
-    combo_state = combo_next_state;
-
     // If we've found a state with an action, record the combo release key.
     if (combo_action != COMBO_NONE) {
         uint16_t keydown_bit = rightmost_bit_16(keydown);
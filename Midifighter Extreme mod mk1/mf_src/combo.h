@@ -41,11 +41,47 @@ typedef enum combo_action {
     COMBO_C_RELEASE,
     COMBO_D_RELEASE,
     COMBO_E_RELEASE,
+    COMBO_PRESET_NEXT = 11,  // switch to the next settings preset
+    COMBO_MENU,              // open the settings menu
 } combo_action_t;
 
+// The DOWN actions send a note until their combo is released, the actions
+// from COMBO_PRESET_NEXT on just fire once.
+#define COMBO_FIRES(action) \
+    (((action) >= COMBO_A_DOWN && (action) <= COMBO_E_DOWN) || \
+     (action) >= COMBO_PRESET_NEXT)
+
+// Constants -------------------------------------------------------------------
+
+// Limits of an uploaded combo table. Each rule is stored in the EEPROM as
+// four bytes: state, key index + keystate test, next state and action. The
+// built-in combos use states 0-36, and every state costs a bit in each of
+// the recognizer's nine state sets, so keep COMBO_MAX_STATES a multiple of 8.
+#define COMBO_MAX_STATES  40
+#define COMBO_MAX_RULES   48
+#define COMBO_RULE_SIZE   4
+
+// Top bits of the key index tell us which keystate to test.
+#define KEYMASK  0xF0
+#define KEYDOWN  0x10
+#define KEYUP    0x20
+#define KEYCHORD 0x30
+
+// Timing. Every key of a chord must go down within COMBO_CHORD_MS of the
+// last, and each step of a sequence must come within COMBO_STEP_MS of the
+// step before. Up to COMBO_MAX_CHORDS chords can be defined. Chords are
+// timed from the start of the keys' hold, so COMBO_CHORD_MS can be at most
+// KEY_HOLD_AGE_MAX.
+#define COMBO_CHORD_MS    60
+#define COMBO_STEP_MS     500
+#define COMBO_MAX_CHORDS  4
+
 // Functions -------------------------------------------------------------------
 
 void combo_setup(void);
+bool combo_load(void);
+void combo_write_byte(uint16_t offset, uint8_t byte);
+bool combo_commit(uint8_t num_rules);
 combo_action_t combo_recognize(const uint16_t keydown,
                                const uint16_t keyup,
                                const uint16_t keystate);
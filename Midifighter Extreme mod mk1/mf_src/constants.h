@@ -25,7 +25,11 @@
 
 // Constant values -------------------------------------------------------------
 
+// Keys must read pressed for DEBOUNCE_BUFFER_SIZE samples in a row before
+// they count as down. Each key's count of samples in a row is kept in
+// DEBOUNCE_COUNT_BITS bit planes, so it must fit in that many bits.
 #define DEBOUNCE_BUFFER_SIZE 10
+#define DEBOUNCE_COUNT_BITS  4
 
 #define SPI_MISO   _BV(PB3)  // SPI master in slave out
 #define SPI_MOSI   _BV(PB2)  // SPI master out slave in
@@ -46,18 +50,45 @@
 
 #define PIC_SELECT EXP_DIGITAL3
 
-#define EEPROM_VERSION  3  // Increment this when the eeprom layout requires
-                           // resetting to the factory default.
+#define EEPROM_VERSION  9  // Increment this when the eeprom layout changes,
+                           // and add a migration from the old layout to
+                           // eeprom_migrations[] in eeprom.c.
 
 // EEPROM memory locations of persistent settings
 #define EE_EEPROM_VERSION      0x0000  // Is the EEPROM layout current?
 #define EE_FIRST_BOOT_CHECK    0x0001  // Hardware passed mfr testing?
+// Settings from here to EE_SETTINGS_SIZE are kept in the settings journal
+// rather than at these addresses, see eeprom.c.
 #define EE_MIDI_CHANNEL        0x0002  // MIDI channel byte (0..15)
 #define EE_MIDI_VELOCITY       0x0003  // MIDI velocity byte (0..127)
 #define EE_KEY_KEYPRESS_LED    0x0004  // Light the LED of pressed keys (bool)
 #define EE_KEY_FOURBANKS       0x0005  // Multiple banks of keys (0..2)
 #define EE_EXP_DIGITAL_ENABLED 0x0006  // Read from Digital pins (4-bits)
 #define EE_EXP_ANALOG_ENABLED  0x0007  // Read from ADC pins (4-bits)
+#define EE_SETTINGS_SIZE       0x0008  // Bytes above are shadowed in RAM
+#define EE_ANALOG_CALIBRATION  0x0008  // Min and max of each pot, 4 bytes
+                                       // each for NUM_ANALOG pots
+#define EE_ANALOG_CURVE        0x0028  // Curve of each pot, NUM_ANALOG bytes
+#define EE_CURVE_CUSTOM        0x0030  // Custom curve, 128 bytes
+#define EE_ANALOG_MAP          0x00B0  // Kind of each analog slot, 2 bits
+                                       // each, a byte per multiplexer pin
+#define EE_COMBO_COUNT         0x00B8  // Rules in the uploaded combo table,
+                                       // 0 for the built-in combos
+#define EE_COMBO_RULES         0x00B9  // Uploaded combo rules, 4 bytes
+                                       // each for COMBO_MAX_RULES rules
+#define EE_PRESETS             0x0180  // Settings presets, EE_PRESET_SIZE
+                                       // bytes each for NUM_PRESETS presets
+#define EE_JOURNAL             0x01A0  // Settings journal, EE_JOURNAL_SLOTS
+                                       // records to the end of the EEPROM
+
+// Settings journal. Each record is a sequence number, the settings from
+// EE_MIDI_CHANNEL on and a CRC.
+#define EE_JOURNAL_SLOTS       12
+#define EE_JOURNAL_RECORD      (EE_SETTINGS_SIZE - EE_MIDI_CHANNEL + 2)
+
+// Settings presets. A preset holds the same settings as the journal.
+#define NUM_PRESETS            4
+#define EE_PRESET_SIZE         (EE_SETTINGS_SIZE - EE_MIDI_CHANNEL)
 
 // Fourbanks modes
 #define FOURBANKS_OFF 0
@@ -74,5 +105,24 @@
 #define SPI_SLAVE_LED 0
 #define SPI_SLAVE_ADC 1
 #define SPI_SLAVE_PIC 2
+#define SPI_NUM_SLAVES 3        // Slaves in the map, one more than the last
+
+// SPI bus scheduler priorities (0 is most urgent, 3 at most) and the bus
+// time each client may use per millisecond tick, in microseconds.
+#define SPI_PRIORITY_LED   0
+#define SPI_PRIORITY_PIC   1
+#define SPI_PRIORITY_ADC   2
+#define SPI_BUDGET_LED_US  100
+#define SPI_BUDGET_PIC_US  100
+#define SPI_BUDGET_ADC_US  700
+
+// SPI clock divider (fck/N) for each slave. The TLC5924 can be clocked at
+// up to 30MHz so it runs flat out. The MCP300x samples its input for 1.5
+// clocks, so the ADC stays at 1MHz to give the pots and multiplexer time to
+// charge the sample capacitor. The PIC's SPI interrupt handler needs about
+// 8us per byte at 3.7 MIPS, so it can't take bytes any faster either.
+#define SPI_CLOCK_LED  2
+#define SPI_CLOCK_ADC  16
+#define SPI_CLOCK_PIC  16
 
 #endif // _CONSTANTS_H_INCLUDED
@@ -0,0 +1,87 @@
+// Response curves for the Midifighter Extreme mod's analog inputs.
+
+#include <avr/pgmspace.h>
+
+#include "curve.h"
+#include "eeprom.h"
+#include "constants.h"
+
+// The built in curves other than linear, which needs no table. With x and
+// y running from 0 to 1 and k = 15 they are:
+//
+//   log  y = log(1 + kx) / log(1 + k)
+//   exp  y = ((1 + k)^x - 1) / k
+//   S    y = 3x^2 - 2x^3
+//
+static const uint8_t curve_table[3][128] PROGMEM = {
+	{
+		  0,   5,  10,  14,  18,  21,  25,  28,  30,  33,  36,  38,  40,  43,  45,  47,
+		 49,  50,  52,  54,  56,  57,  59,  60,  62,  63,  64,  66,  67,  68,  69,  71,
+		 72,  73,  74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  84,  85,  86,
+		 87,  88,  89,  89,  90,  91,  92,  92,  93,  94,  94,  95,  96,  96,  97,  98,
+		 98,  99, 100, 100, 101, 101, 102, 103, 103, 104, 104, 105, 105, 106, 106, 107,
+		107, 108, 109, 109, 110, 110, 110, 111, 111, 112, 112, 113, 113, 114, 114, 115,
+		115, 116, 116, 116, 117, 117, 118, 118, 118, 119, 119, 120, 120, 120, 121, 121,
+		122, 122, 122, 123, 123, 123, 124, 124, 125, 125, 125, 126, 126, 126, 127, 127
+	}, {
+		  0,   0,   0,   1,   1,   1,   1,   1,   2,   2,   2,   2,   3,   3,   3,   3,
+		  4,   4,   4,   4,   5,   5,   5,   6,   6,   6,   6,   7,   7,   7,   8,   8,
+		  9,   9,   9,  10,  10,  11,  11,  11,  12,  12,  13,  13,  14,  14,  15,  15,
+		 16,  16,  17,  17,  18,  18,  19,  20,  20,  21,  22,  22,  23,  24,  24,  25,
+		 26,  27,  27,  28,  29,  30,  31,  31,  32,  33,  34,  35,  36,  37,  38,  39,
+		 40,  41,  42,  43,  45,  46,  47,  48,  49,  51,  52,  53,  55,  56,  57,  59,
+		 60,  62,  63,  65,  67,  68,  70,  72,  74,  75,  77,  79,  81,  83,  85,  87,
+		 89,  91,  94,  96,  98, 100, 103, 105, 108, 110, 113, 116, 118, 121, 124, 127
+	}, {
+		  0,   0,   0,   0,   0,   1,   1,   1,   1,   2,   2,   3,   3,   4,   4,   5,
+		  6,   6,   7,   8,   8,   9,  10,  11,  12,  13,  14,  15,  16,  17,  18,  19,
+		 20,  21,  22,  24,  25,  26,  27,  29,  30,  31,  32,  34,  35,  37,  38,  39,
+		 41,  42,  44,  45,  46,  48,  49,  51,  52,  54,  55,  57,  58,  60,  61,  63,
+		 64,  66,  67,  69,  70,  72,  73,  75,  76,  78,  79,  81,  82,  83,  85,  86,
+		 88,  89,  90,  92,  93,  95,  96,  97,  98, 100, 101, 102, 103, 105, 106, 107,
+		108, 109, 110, 111, 112, 113, 114, 115, 116, 117, 118, 119, 119, 120, 121, 121,
+		122, 123, 123, 124, 124, 125, 125, 126, 126, 126, 126, 127, 127, 127, 127, 127
+	}
+};
+
+const uint8_t curve_smart_knob[128][2] PROGMEM = {
+	{0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x80, 0x00}, {0x81, 0x00}, {0x82, 0x00}, {0x83, 0x00}, {0x84, 0x00},
+	{0x85, 0x00}, {0x86, 0x00}, {0x87, 0x00}, {0x88, 0x00}, {0x89, 0x00}, {0x8a, 0x00}, {0x8b, 0x00}, {0x8c, 0x00},
+	{0x8d, 0x00}, {0x8e, 0x00}, {0x8f, 0x00}, {0x90, 0x00}, {0x91, 0x00}, {0x92, 0x00}, {0x93, 0x00}, {0x94, 0x00},
+	{0x96, 0x00}, {0x97, 0x00}, {0x98, 0x00}, {0x99, 0x00}, {0x9a, 0x00}, {0x9b, 0x00}, {0x9c, 0x00}, {0x9d, 0x00},
+	{0x9e, 0x00}, {0x9f, 0x00}, {0xa0, 0x00}, {0xa1, 0x00}, {0xa2, 0x00}, {0xa3, 0x00}, {0xa4, 0x00}, {0xa5, 0x00},
+	{0xa6, 0x00}, {0xa7, 0x00}, {0xa8, 0x00}, {0xa9, 0x00}, {0xab, 0x00}, {0xac, 0x00}, {0xad, 0x00}, {0xae, 0x00},
+	{0xaf, 0x00}, {0xb0, 0x00}, {0xb1, 0x00}, {0xb2, 0x00}, {0xb3, 0x00}, {0xb4, 0x00}, {0xb5, 0x00}, {0xb6, 0x00},
+	{0xb7, 0x00}, {0xb8, 0x00}, {0xb9, 0x00}, {0xba, 0x00}, {0xbb, 0x00}, {0xbc, 0x00}, {0xbd, 0x00}, {0xbe, 0x00},
+	{0xc0, 0x00}, {0xc1, 0x01}, {0xc2, 0x03}, {0xc3, 0x05}, {0xc4, 0x07}, {0xc5, 0x08}, {0xc6, 0x0a}, {0xc7, 0x0c},
+	{0xc8, 0x0e}, {0xc9, 0x0f}, {0xca, 0x11}, {0xcb, 0x13}, {0xcc, 0x15}, {0xcd, 0x16}, {0xce, 0x18}, {0xcf, 0x1a},
+	{0xd0, 0x1c}, {0xd1, 0x1d}, {0xd2, 0x1f}, {0xd3, 0x21}, {0xd5, 0x23}, {0xd6, 0x24}, {0xd7, 0x26}, {0xd8, 0x28},
+	{0xd9, 0x2a}, {0xda, 0x2b}, {0xdb, 0x2d}, {0xdc, 0x2f}, {0xdd, 0x31}, {0xde, 0x32}, {0xdf, 0x34}, {0xe0, 0x36},
+	{0xe1, 0x38}, {0xe2, 0x39}, {0xe3, 0x3b}, {0xe4, 0x3d}, {0xe5, 0x3f}, {0xe6, 0x40}, {0xe7, 0x42}, {0xe8, 0x44},
+	{0xea, 0x46}, {0xeb, 0x47}, {0xec, 0x49}, {0xed, 0x4b}, {0xee, 0x4d}, {0xef, 0x4e}, {0xf0, 0x50}, {0xf1, 0x52},
+	{0xf2, 0x54}, {0xf3, 0x55}, {0xf4, 0x57}, {0xf5, 0x59}, {0xf6, 0x5b}, {0xf7, 0x5c}, {0xf8, 0x5e}, {0xf9, 0x60},
+	{0xfa, 0x62}, {0xfb, 0x63}, {0xfc, 0x65}, {0xfd, 0x67}, {0xff, 0xe9}, {0xff, 0xe9}, {0xff, 0xe9}, {0xff, 0xe9}
+};
+
+// Look up position x (0..127) on a curve.
+uint8_t curve_apply (uint8_t curve, uint8_t x)
+{
+	x &= 0x7f;
+	switch (curve) {
+	case CURVE_LOG:
+	case CURVE_EXP:
+	case CURVE_S:
+		return pgm_read_byte(&curve_table[curve - CURVE_LOG][x]);
+	case CURVE_CUSTOM:
+		return eeprom_read(EE_CURVE_CUSTOM + x) & 0x7f;
+	default:
+		return x;
+	}
+}
+
+// Set point x of the custom curve to y.
+void curve_set_custom (uint8_t x, uint8_t y)
+{
+	if (x > 127) return;
+	eeprom_write(EE_CURVE_CUSTOM + x, y & 0x7f);
+}
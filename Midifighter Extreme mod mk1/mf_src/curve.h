@@ -0,0 +1,42 @@
+// Response curves for the Midifighter Extreme mod's analog inputs.
+//
+// A curve reshapes a pot's 0..127 position before it is turned into MIDI.
+// The built in curves are 128 entry tables in program memory, the custom
+// curve is 128 entries in the EEPROM that can be uploaded over SysEx.
+
+#ifndef _CURVE_H_INCLUDED
+#define _CURVE_H_INCLUDED
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+// Curves
+
+#define CURVE_LINEAR 0
+#define CURVE_LOG    1  // Fast rise, fine control at the top
+#define CURVE_EXP    2  // Slow rise, fine control at the bottom
+#define CURVE_S      3  // Fine control at both ends
+#define CURVE_CUSTOM 4
+#define NUM_CURVES   5
+
+// The smart knob mapping from a shaped position to MIDI. Entry [v][0] is
+// CC A and [v][1] is CC B, each with the top bit set while its note is on:
+//
+//   0  3             64           124 127
+//   |--|-------------|-------------|--|   - full range
+//
+//      |0=======================127|      - CC A
+//                    |0=========105|      - CC B
+//
+//   |__|on____________________________|   - note A
+//   |off___________________________|on|   - note B
+//      3                          124
+//
+extern const uint8_t curve_smart_knob[128][2] PROGMEM;
+
+// Functions
+
+uint8_t curve_apply (uint8_t curve, uint8_t x);
+void curve_set_custom (uint8_t x, uint8_t y);
+
+#endif
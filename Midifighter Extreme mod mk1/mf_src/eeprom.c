@@ -22,92 +22,659 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <stddef.h>
+#include <string.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 #include "led.h"
 #include "key.h"
 #include "midi.h"
 #include "eeprom.h"
 #include "selftest.h"
 #include "expansion.h"
+#include "curve.h"
+#include "analog.h"
+#include "mod.h"
 #include "constants.h"
 
-// EEPROM functions ------------------------------------------------------------
+// Write-behind cache ----------------------------------------------------------
 
-// Write an 8-bit value to EEPROM memory.
+// An EEPROM write takes about 3.4ms, so rather than waiting on each one we
+// queue them up and start the next one from the EE_READY interrupt as the
+// last one finishes. The settings block at the start of the EEPROM is kept
+// in RAM with a dirty bit per byte, so repeated saves only write the bytes
+// that have changed. Other writes go through a short queue of addresses and
+// values, and a writer only waits if the queue is full. Writers that can
+// put off their writes, like SysEx uploads, check eeprom_write_room()
+// first so that they never wait.
 //
-void eeprom_write(uint16_t address, uint8_t data)
+// The settings most likely to be saved at runtime, from EE_MIDI_CHANNEL
+// on, aren't stored at their own addresses. Each save writes a whole new
+// record to the next slot of a journal, so the wear is spread over
+// EE_JOURNAL_SLOTS slots. A record is a sequence number, the settings and
+// a CRC of both, and at boot we load the valid record with the highest
+// sequence number. A record cut short by a power loss fails its CRC, and
+// the one before it, which we never overwrite, is used instead.
+//
+// The sequence number is written last. A cut record that passes its CRC
+// by chance then still has the sequence number of whatever was in its slot
+// before, which is older, or erased. Erased cells read 0xff, which is never
+// used as a sequence number.
+
+#define EEPROM_QUEUE_SIZE 4
+
+static union {                                      // Settings as saved
+    eeprom_settings_t settings;
+    uint8_t bytes[EE_SETTINGS_SIZE];
+} eeprom_shadow;
+static volatile uint8_t eeprom_dirty;               // Settings to write
+
+static uint16_t eeprom_queue_address[EEPROM_QUEUE_SIZE];
+static uint8_t eeprom_queue_data[EEPROM_QUEUE_SIZE];
+static volatile uint8_t eeprom_queue_head;          // Next write to start
+static volatile uint8_t eeprom_queue_count;         // Writes waiting
+
+static uint8_t eeprom_journal_slot;                 // Slot of newest record
+static uint8_t eeprom_journal_seq;                  // Its sequence number
+static uint8_t eeprom_journal_pos;                  // Next byte to write
+static uint8_t eeprom_journal_crc;                  // CRC of bytes written
+
+// Settings bytes that live in the journal rather than at their address.
+#define EEPROM_JOURNAL_MASK ((uint8_t)(0xff << EE_MIDI_CHANNEL))
+#define EEPROM_CRC_SEED 0xff
+#define EEPROM_SEQ_ERASED 0xff
+
+// The next byte of the record being written to the journal: the settings,
+// the CRC and then the sequence number, which is the first byte of the
+// record. The settings are read from the shadow as they are written and
+// the CRC covers what was actually written, so a setting that changes
+// partway through is either caught by this record or left dirty for the
+// next one.
+//
+static uint8_t eeprom_journal_byte(void)
 {
-    // Wait for completion of previous write
-    while(EECR & (1<<EEPE)) {}
+    uint8_t pos = eeprom_journal_pos++;
+    uint8_t data;
+    if (pos < EE_PRESET_SIZE) {
+        if (pos == 0) {
+            eeprom_journal_crc = _crc_ibutton_update(EEPROM_CRC_SEED,
+                                                     eeprom_journal_seq);
+        }
+        uint8_t i = EE_MIDI_CHANNEL + pos;
+        eeprom_dirty &= ~(1 << i);
+        data = eeprom_shadow.bytes[i];
+        eeprom_journal_crc = _crc_ibutton_update(eeprom_journal_crc, data);
+    } else if (pos == EE_PRESET_SIZE) {
+        data = eeprom_journal_crc;
+    } else {
+        eeprom_journal_pos = 0;
+        data = eeprom_journal_seq;
+    }
+    return data;
+}
+
+// Start the next waiting write, settings first, or turn off the EE_READY
+// interrupt if there are none left. Must be called with interrupts disabled
+// and the EEPROM idle.
+//
+static void eeprom_service(void)
+{
+    uint16_t address;
+    uint8_t data;
+    if (!eeprom_journal_pos && (eeprom_dirty & EEPROM_JOURNAL_MASK)) {
+        // Start a new record in the slot after the newest.
+        eeprom_journal_slot = (eeprom_journal_slot + 1) % EE_JOURNAL_SLOTS;
+        if (++eeprom_journal_seq == EEPROM_SEQ_ERASED) {
+            eeprom_journal_seq = 0;
+        }
+    }
+    if (eeprom_journal_pos || (eeprom_dirty & EEPROM_JOURNAL_MASK)) {
+        address = EE_JOURNAL + eeprom_journal_slot * EE_JOURNAL_RECORD +
+                  (eeprom_journal_pos + 1) % EE_JOURNAL_RECORD;
+        data = eeprom_journal_byte();
+    } else if (eeprom_dirty) {
+        uint8_t i = 0;
+        while (!(eeprom_dirty & (1 << i))) ++i;
+        eeprom_dirty &= ~(1 << i);
+        address = EE_EEPROM_VERSION + i;
+        data = eeprom_shadow.bytes[i];
+    } else if (eeprom_queue_count) {
+        uint8_t head = eeprom_queue_head;
+        address = eeprom_queue_address[head];
+        data = eeprom_queue_data[head];
+        eeprom_queue_head = (head + 1) % EEPROM_QUEUE_SIZE;
+        --eeprom_queue_count;
+    } else {
+        EECR &= ~(1<<EERIE);
+        return;
+    }
     // Set up Address and Data Registers
-    EEAR = address & 0x0fff; // mask out 512 bytes
+    EEAR = address;
     EEDR = data;
-    // This next critical section cannot have an interrupt occur between the
-    // two writes or the write will fail and we will lose the information,
-    // so disable all interrupts for a moment.
-    cli();
     // Write logical one to EEMPE (Master Program Enable) to allow us to
     // write.
     EECR |= (1<<EEMPE);
     // Then within 4 cycles, initiate the eeprom write by writing to the
     // EEPE (Program Enable) strobe.
     EECR |= (1<<EEPE);
-    // Reenable interrupts.
-    sei();
 }
 
-// Read an 8-bit value from EEPROM memory.
+// The EEPROM is ready for another write.
 //
-uint8_t eeprom_read(uint16_t address)
+ISR(EE_READY_vect)
+{
+    eeprom_service();
+}
+
+// Start the next write if the EEPROM is idle. Used while waiting on the
+// queue, as at boot time interrupts are still off and nothing else will.
+//
+static void eeprom_poll(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    if (!(EECR & (1<<EEPE))) {
+        eeprom_service();
+    }
+    SREG = sreg;
+}
+
+
+// EEPROM functions ------------------------------------------------------------
+
+// Write an 8-bit value to EEPROM memory. The write happens in the
+// background, see eeprom_flush() if you need it to have finished.
+//
+void eeprom_write(uint16_t address, uint8_t data)
+{
+    address &= 0x0fff; // mask out 512 bytes
+
+    if (address < EE_SETTINGS_SIZE) {
+        // Settings are only written if they have changed.
+        if (eeprom_shadow.bytes[address] == data) return;
+        uint8_t sreg = SREG;
+        cli();
+        eeprom_shadow.bytes[address] = data;
+        eeprom_dirty |= 1 << address;
+        EECR |= (1<<EERIE);
+        SREG = sreg;
+        return;
+    }
+
+    // Wait for room in the queue.
+    while (eeprom_queue_count == EEPROM_QUEUE_SIZE) {
+        eeprom_poll();
+    }
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t tail = (eeprom_queue_head + eeprom_queue_count) % EEPROM_QUEUE_SIZE;
+    eeprom_queue_address[tail] = address;
+    eeprom_queue_data[tail] = data;
+    ++eeprom_queue_count;
+    EECR |= (1<<EERIE);
+    SREG = sreg;
+}
+
+// Write "length" bytes to EEPROM memory from "data", skipping any that
+// already hold the same value, so that only the differences are written.
+//
+void eeprom_write_bytes(uint16_t address, const void* data, uint8_t length)
+{
+    const uint8_t* bytes = data;
+    for (; length; --length, ++address, ++bytes) {
+        if (eeprom_read(address) != *bytes) {
+            eeprom_write(address, *bytes);
+        }
+    }
+}
+
+// The number of writes outside the settings that eeprom_write() can queue
+// without waiting.
+//
+uint8_t eeprom_write_room(void)
+{
+    return EEPROM_QUEUE_SIZE - eeprom_queue_count;
+}
+
+// Read "length" bytes straight from EEPROM memory, ignoring the cache.
+//
+static void eeprom_read_cells(uint8_t* data, uint16_t address, uint8_t length)
 {
     // Wait for completion of previous write
     while(EECR & (1<<EEPE)) {}
-    // Set up address register
+    for (; length; --length, ++address) {
+        // Set up address register
+        EEAR = address;
+        // Start eeprom read by writing EERE (Read Enable)
+        EECR |= (1<<EERE);
+        // Return data from Data Register
+        *data++ = EEDR;
+    }
+}
+
+// The value at "address", from the shadow, the queue or the EEPROM itself.
+// The interrupt must be held off and the EEPROM idle.
+//
+static uint8_t eeprom_read_cached(uint16_t address)
+{
+    if (address < EE_SETTINGS_SIZE) {
+        return eeprom_shadow.bytes[address];
+    }
+    // Search newest first, so the last value written wins.
+    for (uint8_t i=eeprom_queue_count; i; --i) {
+        uint8_t index = (eeprom_queue_head + i - 1) % EEPROM_QUEUE_SIZE;
+        if (eeprom_queue_address[index] == address) {
+            return eeprom_queue_data[index];
+        }
+    }
     EEAR = address;
-    // Start eeprom read by writing EERE (Read Enable)
     EECR |= (1<<EERE);
-    // Return data from Data Register
     return EEDR;
 }
 
+// Read "length" bytes from EEPROM memory into "data", or the values waiting
+// to be written there. Waits at most once for a write to finish however
+// many bytes are read.
+//
+void eeprom_read_bytes(void* data, uint16_t address, uint8_t length)
+{
+    uint8_t* bytes = data;
+    address &= 0x0fff;
+
+    // Hold off the interrupt so that the queue can't move and no write can
+    // start while we're reading.
+    EECR &= ~(1<<EERIE);
+    while(EECR & (1<<EEPE)) {}
+    for (; length; --length, ++address) {
+        *bytes++ = eeprom_read_cached(address);
+    }
+    if (eeprom_dirty || eeprom_journal_pos || eeprom_queue_count) {
+        EECR |= (1<<EERIE);
+    }
+}
+
+// Read an 8-bit value from EEPROM memory, or the value waiting to be
+// written to it.
+//
+uint8_t eeprom_read(uint16_t address)
+{
+    uint8_t data;
+    eeprom_read_bytes(&data, address, 1);
+    return data;
+}
+
+// Find the newest valid record in a journal of "slots" records at "base"
+// and load its settings into the shadow. Returns false if there isn't one.
+//
+static bool eeprom_journal_load(uint16_t base, uint8_t slots)
+{
+    bool found = false;
+    uint8_t newest = 0;
+    for (uint8_t slot=0; slot<slots; ++slot) {
+        uint8_t record[EE_JOURNAL_RECORD];
+        eeprom_read_cells(record, base + slot * EE_JOURNAL_RECORD,
+                          EE_JOURNAL_RECORD);
+        uint8_t crc = EEPROM_CRC_SEED;
+        for (uint8_t i=0; i<EE_JOURNAL_RECORD - 1; ++i) {
+            crc = _crc_ibutton_update(crc, record[i]);
+        }
+        if (crc != record[EE_JOURNAL_RECORD - 1]) {
+            continue;
+        }
+        // Layout 8 used every sequence number, so only skip 0xff in the
+        // current journal.
+        if (base == EE_JOURNAL && record[0] == EEPROM_SEQ_ERASED) {
+            continue;
+        }
+        // There are far fewer slots than sequence numbers, so the
+        // difference tells us which is newer even across a wrap.
+        if (found && (int8_t)(record[0] - eeprom_journal_seq) <= 0) {
+            continue;
+        }
+        found = true;
+        newest = slot;
+        eeprom_journal_seq = record[0];
+        memcpy(&eeprom_shadow.settings.midi_channel, &record[1],
+               EE_PRESET_SIZE);
+    }
+    if (!found) return false;
+
+    // New records go after this one, wrapped to the current journal.
+    eeprom_journal_slot = newest % EE_JOURNAL_SLOTS;
+    return true;
+}
+
+// Write a new journal record of the settings in the shadow, even if none
+// of them have changed.
+//
+static void eeprom_journal_touch(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    eeprom_dirty |= EEPROM_JOURNAL_MASK;
+    EECR |= (1<<EERIE);
+    SREG = sreg;
+}
+
+// Wait for every waiting write to finish, e.g. before jumping to the
+// bootloader.
+//
+void eeprom_flush(void)
+{
+    while (eeprom_dirty || eeprom_journal_pos || eeprom_queue_count) {
+        eeprom_poll();
+    }
+    while(EECR & (1<<EEPE)) {}
+}
+
+
+// Defaults -------------------------------------------------------------------
+
+// Default values for each part of the layout, used by the factory reset and
+// by migrations that add the part.
+
+// The settings block. Its fields are in the order of the EE_* addresses.
+typedef char eeprom_settings_size_check
+    [(sizeof(eeprom_settings_t) == EE_SETTINGS_SIZE) ? 1 : -1];
+typedef char eeprom_settings_journal_check
+    [(offsetof(eeprom_settings_t, midi_channel) == EE_MIDI_CHANNEL) ? 1 : -1];
+
+static const eeprom_settings_t eeprom_settings_default PROGMEM = {
+    EEPROM_VERSION,                             // This layout version
+    0xff,                                       // No h/w check on first boot
+    2,                                          // MIDI channel (3)
+    127,                                        // MIDI velocity (127)
+    1,                                          // Light LED of pressed key (on)
+    FOURBANKS_OFF,                              // Fourbanks mode (off)
+    0,                                          // Read from digital (all off)
+    0,                                          // Read from analog (all off)
+};
+
+static void eeprom_default_calibration(void)
+{
+    for (uint8_t i=0; i<NUM_ANALOG; ++i) {      // Pot calibration (0..1023)
+        uint16_t address = EE_ANALOG_CALIBRATION + 4*i;
+        eeprom_write(address,     0x00);
+        eeprom_write(address + 1, 0x00);
+        eeprom_write(address + 2, 0xff);
+        eeprom_write(address + 3, 0x03);
+    }
+}
+
+static void eeprom_default_curves(void)
+{
+    for (uint8_t i=0; i<NUM_ANALOG; ++i) {      // Pot curve (linear)
+        eeprom_write(EE_ANALOG_CURVE + i, CURVE_LINEAR);
+    }
+    for (uint8_t i=0; i<128; ++i) {             // Custom curve (linear)
+        eeprom_write(EE_CURVE_CUSTOM + i, i);
+    }
+}
+
+static void eeprom_default_map(void)
+{
+    for (uint8_t i=0; i<ANALOG_MUX_PINS; ++i) { // Channel map (mod layout)
+        uint8_t kinds = ANALOG_UNUSED;
+        if (i < NUM_ANALOG_PINS) kinds = ANALOG_POT * 0x55;
+        if (i >= ANALOG_BUTTON_MUX) kinds = ANALOG_BUTTON * 0x55;
+        eeprom_write(EE_ANALOG_MAP + i, kinds);
+    }
+}
+
+static void eeprom_default_combos(void)
+{
+    eeprom_write(EE_COMBO_COUNT,         0);    // Combos (built-in)
+}
+
+// Written from the last byte back, see eeprom_migrate_8().
+static void eeprom_default_presets(void)
+{
+    eeprom_settings_t settings;
+    memcpy_P(&settings, &eeprom_settings_default, sizeof(settings));
+    for (uint8_t i=NUM_PRESETS; i--; ) {        // Presets (channels 3..6)
+        settings.midi_channel = 2 + i;
+        const uint8_t* bytes = &settings.midi_channel;
+        for (uint8_t j=EE_PRESET_SIZE; j--; ) {
+            eeprom_write_bytes(EE_PRESETS + i * EE_PRESET_SIZE + j,
+                               &bytes[j], 1);
+        }
+    }
+}
+
+
+// Migrations -----------------------------------------------------------------
+
+// Each migration takes the layout of one version to the next, keeping the
+// values already there and giving any new ones their defaults. Settings
+// are brought into the shadow and journaled from there, wherever the old
+// layout kept them.
+
+// Layout 4 added the pot calibration.
+static void eeprom_migrate_3(void)
+{
+    eeprom_default_calibration();
+}
+
+// Layout 5 added the pot curves.
+static void eeprom_migrate_4(void)
+{
+    eeprom_default_curves();
+}
+
+// Layout 6 added the analog channel map.
+static void eeprom_migrate_5(void)
+{
+    eeprom_default_map();
+}
+
+// Layout 7 added uploaded combo tables.
+static void eeprom_migrate_6(void)
+{
+    eeprom_default_combos();
+}
+
+// Layout 8 moved the settings from their own cells into the journal.
+static void eeprom_migrate_7(void)
+{
+    eeprom_read_cells(&eeprom_shadow.settings.midi_channel, EE_MIDI_CHANNEL,
+                      EE_PRESET_SIZE);
+    eeprom_journal_touch();
+}
+
+// Layout 9 added the presets where the journal started, and moved the
+// journal after them. The layout 8 journal had 16 slots from EE_PRESETS.
+// Coming from layout 7 there's no journal to find there, as erased cells
+// fail the CRC, and the settings already in the shadow are kept.
+//
+// The presets overwrite the first old slots, so the settings are written
+// to the new journal first. Its next slot is never the old newest one, so
+// a power loss leaves one of the two records to migrate from again.
+//
+// A migration cut short while writing the presets runs again over a mix of
+// old records and preset bytes, which can pass the CRC by chance. So the
+// old records under the presets are first aged behind the new one, and the
+// presets are written backwards, leaving the sequence number of each old
+// record until last. Until then a mix can only pass for an older record,
+// and once each one is complete it holds the default presets, which fail
+// the CRC.
+#define EEPROM_PRESET_SLOTS_8 \
+    ((NUM_PRESETS * EE_PRESET_SIZE + EE_JOURNAL_RECORD - 1) / EE_JOURNAL_RECORD)
+
+static void eeprom_migrate_8(void)
+{
+    eeprom_journal_load(EE_PRESETS, 16);
+    eeprom_journal_touch();
+    eeprom_flush();
+    for (uint8_t slot=0; slot<EEPROM_PRESET_SLOTS_8; ++slot) {
+        eeprom_write(EE_PRESETS + slot * EE_JOURNAL_RECORD,
+                     eeprom_journal_seq - 0x40);
+    }
+    eeprom_default_presets();
+}
+
+#define EEPROM_OLDEST_VERSION 3
+
+typedef void (*eeprom_migration_t)(void);
+
+// The migration from each layout version, from EEPROM_OLDEST_VERSION on.
+static const eeprom_migration_t eeprom_migrations[] PROGMEM = {
+    eeprom_migrate_3,
+    eeprom_migrate_4,
+    eeprom_migrate_5,
+    eeprom_migrate_6,
+    eeprom_migrate_7,
+    eeprom_migrate_8,
+};
+
+// Bring a layout of "version" up to date, one version at a time. The new
+// version is only written once everything else has been, so if the power
+// goes part way through, the migration runs again from the start at the
+// next boot.
+//
+static void eeprom_migrate(uint8_t version)
+{
+    for (; version < EEPROM_VERSION; ++version) {
+        eeprom_migration_t migrate = (eeprom_migration_t)
+            pgm_read_word(&eeprom_migrations[version - EEPROM_OLDEST_VERSION]);
+        migrate();
+    }
+    eeprom_flush();
+    eeprom_write(EE_EEPROM_VERSION, EEPROM_VERSION);
+}
+
 
 // System functions -----------------------------------------------------------
 
+// Copy the settings block out to the global values, all at once.
+//
+static void eeprom_settings_apply(void)
+{
+    const eeprom_settings_t* settings = &eeprom_shadow.settings;
+    uint8_t sreg = SREG;
+    cli();
+    g_self_test_passed = settings->first_boot_check;
+    g_midi_channel = settings->midi_channel;
+    g_midi_velocity = settings->midi_velocity;
+    g_led_keypress_enable = settings->keypress_led;
+    g_key_fourbanks_mode = settings->fourbanks;
+    g_exp_digital_read = settings->exp_digital;
+    g_exp_analog_read = settings->exp_analog;
+    SREG = sreg;
+}
+
+// Check the settings in the shadow only hold values this firmware knows.
+// Migrated layouts are taken on trust, and an old firmware may have left
+// anything in the cells a migration moves.
+//
+static bool eeprom_settings_valid(void)
+{
+    const eeprom_settings_t* settings = &eeprom_shadow.settings;
+    return settings->midi_channel <= 0x0f &&
+           settings->midi_velocity <= 0x7f &&
+           settings->keypress_led <= 1 &&
+           settings->fourbanks <= FOURBANKS_EXTERNAL &&
+           settings->exp_digital <= 0x0f &&
+           settings->exp_analog <= 0x0f;
+}
+
 // Set up the EEPROM system for use and read out the settings into the
 // global values.
 //
 // This includes checking the layout version and, if the version tag written
-// to the EEPROM doesn't match this software version we're running, we reset
-// the EEPROM values to their default settings.
+// to the EEPROM is older than this software version we're running, we
+// migrate the old layout, keeping every value it had. Only if the version
+// is one we don't know, or the settings we end up with aren't valid, do we
+// reset the EEPROM values to their default settings.
 //
 void eeprom_setup(void)
 {
-    // If our EEPROM layout has changed, reset everything.
-    if (eeprom_read(EE_EEPROM_VERSION) != EEPROM_VERSION) {
+    // Fill the cache of the settings block, from the journal for all but
+    // the first few.
+    eeprom_read_cells(eeprom_shadow.bytes, EE_EEPROM_VERSION, EE_MIDI_CHANNEL);
+    bool journal_found = eeprom_journal_load(EE_JOURNAL, EE_JOURNAL_SLOTS);
+
+    // If our EEPROM layout is an older one, bring it up to date. If it's
+    // one we don't know, or the journal has no valid record, reset
+    // everything.
+    uint8_t version = eeprom_read(EE_EEPROM_VERSION);
+    if (version >= EEPROM_OLDEST_VERSION && version < EEPROM_VERSION) {
+        eeprom_migrate(version);
+    } else if (version != EEPROM_VERSION || !journal_found) {
+        eeprom_factory_reset();
+    }
+
+    // Check the settings after the migration, and at every boot after that
+    // in case the power went before we could reset them.
+    if (!eeprom_settings_valid()) {
         eeprom_factory_reset();
     }
 
     // Read the EEPROM into the global settings.
-    g_self_test_passed = eeprom_read(EE_FIRST_BOOT_CHECK);
-    g_midi_channel = eeprom_read(EE_MIDI_CHANNEL);
-    g_midi_velocity = eeprom_read(EE_MIDI_VELOCITY);
-    g_led_keypress_enable = eeprom_read(EE_KEY_KEYPRESS_LED);
-    g_key_fourbanks_mode = eeprom_read(EE_KEY_FOURBANKS);
-    g_exp_digital_read = eeprom_read(EE_EXP_DIGITAL_ENABLED);
-    g_exp_analog_read = eeprom_read(EE_EXP_ANALOG_ENABLED);
+    eeprom_settings_apply();
 }
 
 // Used by the menu system, if we have edited any of the global values then
-// save them off to the EEPROM.
+// save them off to the EEPROM. Values that haven't changed aren't written,
+// and the rest are written in the background.
 //
 void eeprom_save_edits(void)
 {
-    eeprom_write(EE_MIDI_CHANNEL, g_midi_channel);
-    eeprom_write(EE_MIDI_VELOCITY, g_midi_velocity);
-    eeprom_write(EE_KEY_KEYPRESS_LED, g_led_keypress_enable);
-    eeprom_write(EE_KEY_FOURBANKS, g_key_fourbanks_mode);
-    eeprom_write(EE_EXP_DIGITAL_ENABLED, g_exp_digital_read);
-    eeprom_write(EE_EXP_ANALOG_ENABLED, g_exp_analog_read);
+    eeprom_settings_t settings = eeprom_shadow.settings;
+    settings.midi_channel = g_midi_channel;
+    settings.midi_velocity = g_midi_velocity;
+    settings.keypress_led = g_led_keypress_enable;
+    settings.fourbanks = g_key_fourbanks_mode;
+    settings.exp_digital = g_exp_digital_read;
+    settings.exp_analog = g_exp_analog_read;
+    eeprom_write_bytes(EE_EEPROM_VERSION, &settings, sizeof(settings));
+}
+
+// Presets --------------------------------------------------------------------
+
+uint8_t g_preset = 0;  // Preset last switched to (0..NUM_PRESETS-1)
+
+// Switch to the settings of preset "preset". They are read in one block and
+// then all applied at once, so the main loop never sees half of a preset,
+// and saved to the journal so they're still there at the next boot.
+//
+void eeprom_preset_load(uint8_t preset)
+{
+    if (preset >= NUM_PRESETS) return;
+
+    eeprom_settings_t settings = eeprom_shadow.settings;
+    eeprom_read_bytes(&settings.midi_channel,
+                      EE_PRESETS + preset * EE_PRESET_SIZE, EE_PRESET_SIZE);
+    // Presets can be uploaded over SysEx, so don't trust them to hold
+    // values we know.
+    settings.midi_channel &= 0x0f;
+    settings.midi_velocity &= 0x7f;
+    if (settings.fourbanks > FOURBANKS_EXTERNAL) {
+        settings.fourbanks = FOURBANKS_OFF;
+    }
+    settings.exp_digital &= 0x0f;
+    settings.exp_analog &= 0x0f;
+
+    uint8_t analog_read = g_exp_analog_read;
+    eeprom_write_bytes(EE_EEPROM_VERSION, &settings, sizeof(settings));
+    eeprom_settings_apply();
+    g_key_bank_selected = 0;
+    g_preset = preset;
+
+    // Pots on analog inputs the preset turns on haven't had their noise
+    // measured, so measure them all again.
+    if (g_exp_analog_read != analog_read) {
+        analog_measure_noise();
+    }
+}
+
+// Store byte "index" of the settings of preset "preset", in the order they
+// are journaled (MIDI channel first).
+//
+void eeprom_preset_write(uint8_t preset, uint8_t index, uint8_t data)
+{
+    if (preset >= NUM_PRESETS || index >= EE_PRESET_SIZE) return;
+    eeprom_write(EE_PRESETS + preset * EE_PRESET_SIZE + index, data);
 }
 
 // Return the EEPROM values to their factory default values, erasing any
@@ -118,26 +685,22 @@ void eeprom_factory_reset(void)
     // NOTE: hardware check on first boot only occurs if the eeprom was zeroed.
     // and not every time we reflash an eeprom. That keeps it a rare event.
 
-    eeprom_write(EE_EEPROM_VERSION,      EEPROM_VERSION); // This layout version
-    eeprom_write(EE_FIRST_BOOT_CHECK,    0xff); // No h/w check on first boot
-    eeprom_write(EE_MIDI_CHANNEL,        2);    // MIDI channel (3)
-    eeprom_write(EE_MIDI_VELOCITY,       127);  // MIDI velocity (127)
-    eeprom_write(EE_KEY_KEYPRESS_LED ,   1);    // Light LED of pressed key (on)
-    eeprom_write(EE_KEY_FOURBANKS,       FOURBANKS_OFF); // Fourbanks mode (off)
-    eeprom_write(EE_EXP_DIGITAL_ENABLED, 0);    // Read from digital (all off)
-    eeprom_write(EE_EXP_ANALOG_ENABLED,  0);    // Read from analog (all off)
+    eeprom_settings_t settings;                 // Settings (defaults)
+    memcpy_P(&settings, &eeprom_settings_default, sizeof(settings));
+    eeprom_write_bytes(EE_EEPROM_VERSION, &settings, sizeof(settings));
+    eeprom_journal_touch();                     // (journal even if unchanged)
+    eeprom_default_calibration();
+    eeprom_default_curves();
+    eeprom_default_map();
+    eeprom_default_combos();
+    eeprom_default_presets();
 
     // Reset the global variables to their default versions, as they were
     // read with their old values before the factory reset happened and they
     // could get written back if the user leaves menu mode through the exit
     // button.
-    g_self_test_passed = 0xff;
-    g_midi_channel = 2;
-    g_midi_velocity = 127;
-    g_led_keypress_enable = 1;
-    g_key_fourbanks_mode = FOURBANKS_OFF;
-    g_exp_digital_read = 0;
-    g_exp_analog_read = 0;
+    eeprom_settings_apply();
+    g_preset = 0;
 
     // Flash to signal success.
     led_set_state(0xffff);
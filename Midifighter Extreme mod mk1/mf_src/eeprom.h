@@ -23,12 +23,40 @@
 #ifndef _EEPROM_H_INCLUDED
 #define _EEPROM_H_INCLUDED
 
+// Settings -------------------------------------------------------
+
+// The settings block at the start of the EEPROM, one field for each EE_*
+// address below EE_SETTINGS_SIZE. It is loaded and kept in RAM as a whole,
+// and the part from midi_channel on is what the journal and the presets
+// store.
+typedef struct eeprom_settings {
+    uint8_t version;           // EE_EEPROM_VERSION
+    uint8_t first_boot_check;  // EE_FIRST_BOOT_CHECK
+    uint8_t midi_channel;      // EE_MIDI_CHANNEL
+    uint8_t midi_velocity;     // EE_MIDI_VELOCITY
+    uint8_t keypress_led;      // EE_KEY_KEYPRESS_LED
+    uint8_t fourbanks;         // EE_KEY_FOURBANKS
+    uint8_t exp_digital;       // EE_EXP_DIGITAL_ENABLED
+    uint8_t exp_analog;        // EE_EXP_ANALOG_ENABLED
+} eeprom_settings_t;
+
 // EEPROM functions -----------------------------------------------
 
 void eeprom_write(uint16_t address, uint8_t data);
+void eeprom_write_bytes(uint16_t address, const void* data, uint8_t length);
+uint8_t eeprom_write_room(void);
 uint8_t eeprom_read(uint16_t address);
+void eeprom_read_bytes(void* data, uint16_t address, uint8_t length);
+void eeprom_flush(void);
 void eeprom_factory_reset(void);
 void eeprom_setup(void);
 void eeprom_save_edits(void);
 
+// Presets --------------------------------------------------------
+
+extern uint8_t g_preset;
+
+void eeprom_preset_load(uint8_t preset);
+void eeprom_preset_write(uint8_t preset, uint8_t index, uint8_t data);
+
 #endif // _EEPROM_H_INCLUDED
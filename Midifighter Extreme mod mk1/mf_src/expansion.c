@@ -21,7 +21,6 @@
 // rgreen 2009-11-24
 
 #include <avr/io.h>
-#include "adc.h"
 #include "constants.h"
 #include "expansion.h"
 
@@ -38,16 +37,15 @@ uint8_t g_exp_digital_read;   // 4-bits of "enabled" flags, one for each pin.
 uint8_t g_exp_analog_read;    // 4-bits of "enabled" flags, one for each pin.
 
 // Key states for the expansion port inputs.
-uint8_t g_exp_key_debounce_buffer[DEBOUNCE_BUFFER_SIZE];
+uint8_t g_exp_key_debounce_count[DEBOUNCE_COUNT_BITS];
 uint8_t g_exp_key_state;
 uint8_t g_exp_key_prev_state;
 uint8_t g_exp_key_down;
 uint8_t g_exp_key_up;
 
-// Array of previous ADC values for the analog reads, each one the full
-// 10-bit range so we can track the lower bits and add hysteresis into
-// the value changes.
-uint16_t g_exp_analog_prev[NUM_ANALOG];
+// Array of the shaped position (0..127) last sent for each analog input.
+// They are set once the pots have been calibrated, see main().
+uint8_t g_exp_analog_prev[NUM_ANALOG];
 
 
 // Functions -----------------------------------------------------------------
@@ -55,17 +53,25 @@ uint16_t g_exp_analog_prev[NUM_ANALOG];
 // Setup the expansion port for reading.
 void exp_setup()
 {
-    // NOTE: This function assumes that SPI has already been setup.
-
     // Setup the digital pins as inputs and turn on the pull-up resistor.
     DDRD &= ~(EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2 + EXP_DIGITAL3);
     PORTD |= EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2 + EXP_DIGITAL3;
+}
 
-    // Read the four analog ports to generate an initial set of "previous"
-    // values that we will be testing against.
-    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
-        g_exp_analog_prev[i] = adc_read(i);
+// The inputs whose debounce counters have reached DEBOUNCE_BUFFER_SIZE. For
+// more on how the counters work see comments in "key.c"
+//
+static uint8_t exp_key_debounced(void)
+{
+    uint8_t full = 0xff;
+    for (uint8_t i=0; i<DEBOUNCE_COUNT_BITS; ++i) {
+        if (DEBOUNCE_BUFFER_SIZE & (1 << i)) {
+            full &= g_exp_key_debounce_count[i];
+        } else {
+            full &= ~g_exp_key_debounce_count[i];
+        }
     }
+    return full;
 }
 
 // This function is designed to be used inside the key-read interrupt
@@ -74,17 +80,18 @@ void exp_setup()
 //
 void exp_buffer_digital_inputs(void)
 {
-    // Where to write the next value in the ring buffer.
-    static uint8_t ext_buffer_pos = 0;
     // Read the input from port D. As there is a single bit for each input,
     // a single read will give us all the bits we need. We shift the bits
     // down to the bottom of the byte and invert them, as an open key should
     // read as a "1" (just like on the main keyboard).
     uint8_t value = (PIND >> 2) ^ 0x0f;
-    // Store the new value in our ring buffer and increment the ring buffer
-    // offset, wrapping the write position to a point inside the buffer.
-    g_exp_key_debounce_buffer[ext_buffer_pos] = value;
-    ext_buffer_pos = (ext_buffer_pos + 1) % DEBOUNCE_BUFFER_SIZE;
+    // Count the new sample in the debounce counters.
+    uint8_t carry = value & ~exp_key_debounced();
+    for (uint8_t i=0; i<DEBOUNCE_COUNT_BITS; ++i) {
+        uint8_t plane = g_exp_key_debounce_count[i];
+        g_exp_key_debounce_count[i] = (plane ^ carry) & value;
+        carry &= plane;
+    }
 }
 
 // Generate a debounced read of the digital input ports. For more on how
@@ -92,10 +99,7 @@ void exp_buffer_digital_inputs(void)
 //
 uint8_t exp_key_read(void)
 {
-    g_exp_key_state = 0xff;
-    for(uint8_t i=0; i<DEBOUNCE_BUFFER_SIZE; ++i) {
-        g_exp_key_state &= g_exp_key_debounce_buffer[i];
-    }
+    g_exp_key_state = exp_key_debounced();
     return g_exp_key_state;
 }
 
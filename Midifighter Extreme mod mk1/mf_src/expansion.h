@@ -29,7 +29,7 @@
 // global values -------------------------------------------------------------
 
 #ifdef MULTIPLEX_ANALOG
-// should be less than or equal to (4 * NUM_ANALOG_PINS)
+// the most pots the mod's channel map can have
    #define NUM_ANALOG 8
 #else
    #define NUM_ANALOG 4
@@ -40,15 +40,14 @@ extern uint8_t g_exp_digital_read;
 extern uint8_t g_exp_analog_read;
 
 // Key states for the expansion port inputs.
-extern uint8_t g_exp_key_debounce_buffer[];
+extern uint8_t g_exp_key_debounce_count[];
 extern uint8_t g_exp_key_state;
 extern uint8_t g_exp_key_prev_state;
 extern uint8_t g_exp_key_down;
 extern uint8_t g_exp_key_up;
 
-// Array of previous ADC values for the analog reads, each one the full
-// 10-bit range.
-extern uint16_t g_exp_analog_prev[NUM_ANALOG];
+// Array of the shaped position last sent for each analog input.
+extern uint8_t g_exp_analog_prev[NUM_ANALOG];
 
 // functions -----------------------------------------------------------------
 
@@ -32,12 +32,18 @@
 uint8_t g_key_fourbanks_mode;  // Which four banks mode are we using?
 uint8_t g_key_bank_selected;   // Which bank is currently active?
 
-uint16_t g_key_debounce_buffer[DEBOUNCE_BUFFER_SIZE]; // The debounce buffer
+uint16_t g_key_debounce_count[DEBOUNCE_COUNT_BITS]; // The debounce counters
+typedef char key_debounce_check
+    [(DEBOUNCE_BUFFER_SIZE < (1 << DEBOUNCE_COUNT_BITS)) ? 1 : -1];
 uint16_t g_key_state = 0;      // Current state of the keys after debounce.
 uint16_t g_key_prev_state = 0; // State of the keys when last polled.
 uint16_t g_key_up = 0;         // Key was released since last poll.
 uint16_t g_key_down = 0;       // Key was pressed since last poll.
 
+volatile uint16_t g_key_ticks = 0; // Key scans since startup (~1ms each).
+uint16_t g_key_edge_tick = 0;  // Tick the keys last went down or up.
+uint16_t g_key_hold_tick = 0;  // Tick the keys now held started going down.
+
 
 // Key Functions --------------------------------------------------
 
@@ -59,12 +65,12 @@ void key_setup(void)
     // also start it off high.
     PORTC |= KEY_LATCH & KEY_CLOCK;
 
-    // Start the debounce buffer in an empty state.
-    memset(g_key_debounce_buffer, 0, DEBOUNCE_BUFFER_SIZE*sizeof(uint16_t));
+    // Start the debounce counters in an empty state.
+    memset(g_key_debounce_count, 0, sizeof(g_key_debounce_count));
 
     // Setup TIMER0 to trigger an overflow interrupt 1000 times a second.
     // Our counter is incremented every 256 / 16000000 = 0.000016 seconds.
-    // Our key debounce buffer is 10 samples, meaning we need the counter
+    // Our key debouncer counts 10 samples, meaning we need the counter
     // to count to x where (256*10*x)/16000000 = 0.001 seconds. This gives us
     // A counter value of 62.5 (rounded to 62), but the counter increments
     // from a base number to the overflow point at 255 so we need to set
@@ -102,9 +108,28 @@ void key_disable(void)
 }
 
 
+// The keys whose debounce counters have reached DEBOUNCE_BUFFER_SIZE. Bit
+// plane i of the counters holds bit i of every key's count, so all 16 keys
+// are compared at once, and counted at once by a ripple carry.
+//
+static uint16_t key_debounced(void)
+{
+    uint16_t full = 0xffff;
+    for (uint8_t i=0; i<DEBOUNCE_COUNT_BITS; ++i) {
+        if (DEBOUNCE_BUFFER_SIZE & (1 << i)) {
+            full &= g_key_debounce_count[i];
+        } else {
+            full &= ~g_key_debounce_count[i];
+        }
+    }
+    return full;
+}
+
 // The key read Interrupt Service Routine (ISR). This is called at 1008Hz
-// by Timer0 overflow interrupt and used to poll the key states and drop
-// the results into a ring buffer for later analysis by the key debouncer.
+// by Timer0 overflow interrupt and used to poll the key states and count
+// the results in the debounce counters for the key debouncer: every key
+// read pressed that hasn't reached DEBOUNCE_BUFFER_SIZE gets one more,
+// and every key read released goes back to zero.
 //
 // The two 74HC165 chips share use the same clock (PC5) and latch lines (PC7),
 // so each clock we have to pick up two bits of value, on pins PC4 (SW9 to
@@ -112,12 +137,11 @@ void key_disable(void)
 //
 ISR(TIMER0_OVF_vect)
 {
-    // Where to write the next value in the ring buffer.
-    static uint8_t buffer_pos = 0;
-
     // The counter just overflowed, so reset the counter to the magic number
     // 193 (see above).
     TCNT0 = 0xC1;
+    // Advance the millisecond clock.
+    ++g_key_ticks;
     // Latch the key read (active LOW, reset to HI).
     PORTC &= ~KEY_LATCH;
     PORTC |= KEY_LATCH;
@@ -133,10 +157,13 @@ ISR(TIMER0_OVF_vect)
         value |= (PINC & KEY_HIBIT) ? 0 : (1 << (15-i));
         PORTC |= KEY_CLOCK; // clock works on a rising edge
     }
-    // Store the new value in our ring buffer and increment the ring buffer
-    // offset, wrapping the write position to a point inside the buffer.
-    g_key_debounce_buffer[buffer_pos] = value;
-    buffer_pos = (buffer_pos + 1) % DEBOUNCE_BUFFER_SIZE;
+    // Count the new sample in the debounce counters.
+    uint16_t carry = value & ~key_debounced();
+    for (uint8_t i=0; i<DEBOUNCE_COUNT_BITS; ++i) {
+        uint16_t plane = g_key_debounce_count[i];
+        g_key_debounce_count[i] = (plane ^ carry) & value;
+        carry &= plane;
+    }
 
     // If we have enabled the digital inputs, read them into their debounce
     // buffer.
@@ -145,13 +172,13 @@ ISR(TIMER0_OVF_vect)
     }
 }
 
-// Read the current keystate by reconstructing the key samples from the
-// debounce buffer by ANDing together all the samples. Each bit represents a
-// single sample of one key, so the columns line up to represent that state
-// of a single key over time. The result of this read is stored in the
-// global variable "g_key_state".
+// Read the current keystate from the debounce counters. A key is down once
+// it has read pressed for DEBOUNCE_BUFFER_SIZE samples in a row, which is
+// the same as ANDing together the last DEBOUNCE_BUFFER_SIZE samples, and up
+// as soon as one sample reads released. The result of this read is stored
+// in the global variable "g_key_state".
 //
-// NOTE: If any bit is set in the column, the key is considered "activated",
+// NOTE: If any sample reads released, the key is considered released,
 // so this debouncer is good at recognizing bounces on press/release but
 // doesn't filter or surpress transitory EMF bits. If you've got EMF bits
 // being triggered on a Midifighter, you have bigger problems than
@@ -162,11 +189,7 @@ ISR(TIMER0_OVF_vect)
 //
 uint16_t key_read(void)
 {
-    // Debounce the keys by ANDing the columns of key samples together.
-    g_key_state = 0xffff;
-    for(uint8_t i=0; i<DEBOUNCE_BUFFER_SIZE; ++i) {
-        g_key_state &= g_key_debounce_buffer[i];
-    }
+    g_key_state = key_debounced();
     return g_key_state;
 }
 
@@ -185,4 +208,34 @@ void key_calc(void)
     g_key_up = (g_key_prev_state ^ g_key_state) & g_key_prev_state;
     // Demote the current state to history.
     g_key_prev_state = g_key_state;
+
+    // Timestamp the keys, for timing combos. A hold starts when a key goes
+    // down with none of the others held. A key let go of while others stay
+    // held leaves no way to tell when those went down, so the hold is aged
+    // out, as is one held long enough that its age could wrap round.
+    uint16_t now = key_ticks();
+    if (g_key_down | g_key_up) {
+        g_key_edge_tick = now;
+        if (g_key_down && !(g_key_state & ~g_key_down)) {
+            g_key_hold_tick = now;
+        } else if (g_key_up && g_key_state) {
+            g_key_hold_tick = now - KEY_HOLD_AGE_MAX - 1;
+        }
+    }
+    if ((uint16_t)(now - g_key_hold_tick) > KEY_HOLD_AGE_MAX) {
+        g_key_hold_tick = now - KEY_HOLD_AGE_MAX - 1;
+    }
+}
+
+// Read the millisecond clock. The counter is 16 bits wide and updated from
+// the key scan interrupt, so interrupts are held off while we read both
+// bytes.
+//
+uint16_t key_ticks(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t ticks = g_key_ticks;
+    SREG = sreg;
+    return ticks;
 }
@@ -37,8 +37,8 @@ extern uint8_t g_key_fourbanks_mode;
 // Range is 0..3
 extern uint8_t g_key_bank_selected;
 
-// The key debounce buffer.
-extern uint16_t g_key_debounce_buffer[DEBOUNCE_BUFFER_SIZE];
+// The key debounce counters.
+extern uint16_t g_key_debounce_count[DEBOUNCE_COUNT_BITS];
 
 // The key states (after debounce).
 extern uint16_t g_key_state;      // Current state of the keys.
@@ -46,6 +46,18 @@ extern uint16_t g_key_prev_state; // State of the keys when last polled.
 extern uint16_t g_key_up;         // Key was released since last poll.
 extern uint16_t g_key_down;       // Key was pressed since last poll.
 
+// Free running count of key scan interrupts, roughly one per millisecond.
+extern volatile uint16_t g_key_ticks;
+
+// The tick on which the keys last went down or up, and the tick on which
+// the first of the keys now held went down. Letting go of a key while
+// others stay held loses the times of those left, so they age straight
+// to KEY_HOLD_AGE_MAX. Hold ages are exact up to KEY_HOLD_AGE_MAX, and
+// never wrap round to look recent.
+#define KEY_HOLD_AGE_MAX 127
+extern uint16_t g_key_edge_tick;
+extern uint16_t g_key_hold_tick;
+
 // Interrupt service routine ---------------------------------------------------
 
 ISR(TIMER0_OVF_vect);
@@ -56,5 +68,6 @@ void key_setup(void);
 void key_disable(void);
 uint16_t key_read(void);
 void key_calc(void);
+uint16_t key_ticks(void);
 
 #endif // _KEY_H_INCLUDED
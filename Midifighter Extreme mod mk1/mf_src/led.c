@@ -22,6 +22,7 @@
 
 #include <stdbool.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 #include "led.h"
 #include "spi.h"
@@ -35,6 +36,14 @@ uint16_t g_led_state = 0x0000;       // Current LED state, copied from last
                                      // call to led_set_state()
 uint16_t g_led_groundfx_counter = 0; // Counter for the ground FX MIDI clock.
 
+// The most recently requested LED state, waiting for the SPI bus scheduler
+// to send it.
+static volatile uint16_t led_pending_state = 0x0000;
+
+// Forward declarations --------------------------------------------------------
+
+static uint8_t led_flush(void);
+
 // Basic functions -------------------------------------------------------------
 
 // setup the LEDS for writing.
@@ -42,6 +51,8 @@ uint16_t g_led_groundfx_counter = 0; // Counter for the ground FX MIDI clock.
 void led_setup(void)
 {
 	spi_install_slave(SPI_SLAVE_LED, SPI_PORT_B, LED_LATCH, SPI_LOW_TO_SELECT);
+	spi_configure_slave(SPI_SLAVE_LED, SPI_CLOCK_LED, SPI_MODE_0);
+	spi_install_client(SPI_SLAVE_LED, SPI_PRIORITY_LED, SPI_BUDGET_LED_US, led_flush);
 	
     // Yes, this inits the SPI master device again. We made sure it is safe
     // to do so. just in case you're only playing with the lights.
@@ -49,6 +60,7 @@ void led_setup(void)
     // Initialize the LED state tracking, so we only send LED updates when
     // something has changed.
     g_led_state = 0x0000;
+    led_pending_state = 0x0000;
     g_led_midi_state = 0x0000;
     // Set the LED_BLANK pin to be an output.
     DDRB |= LED_BLANK;
@@ -71,23 +83,39 @@ void led_setup(void)
 //    9 10 11 12
 //   13 14 15 16
 //
+// The new state is handed to the SPI bus scheduler, which sends it straight
+// away unless the bus is in use or the LEDs have used up their bus time for
+// this millisecond, in which case it goes out as soon as possible.
+//
 void led_set_state(uint16_t new_state)
 {	
     // If no lights have changed, transmit nothing. This saves bandwidth on
     // the SPI bus for more important things.
-    if (g_led_state == new_state) return;
-	spi_select(SPI_SLAVE_LED); // Pull LAT low
-	
+    if (led_pending_state == new_state) return;
+    led_pending_state = new_state;
+    spi_post(SPI_SLAVE_LED);
+}
+
+// Send the pending LED state to the TLC5924. Called by the SPI bus
+// scheduler with LAT pulled low, the result is latched to the LEDs when the
+// scheduler pulls it high again.
+//
+static uint8_t led_flush(void)
+{
+    // led_set_state() can be called from the USB interrupt, so take a
+    // consistent copy of the pending state.
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t state = led_pending_state;
+    SREG = sreg;
+
     // Transmit Most Significant Byte first.
-    spi_transmit(new_state >> 8);
-    spi_transmit(new_state & 0xff);
-    // Latch the result to the LEDs by pulsing high.
-    //PORTB |= LED_LATCH;
-    //PORTB &= ~LED_LATCH;
-	spi_select_none(); // Pull LAT high
-	
+    spi_transmit(state >> 8);
+    spi_transmit(state & 0xff);
+
     // record the state.
-    g_led_state = new_state;
+    g_led_state = state;
+    return 2;
 }
 
 // Turn on or off the Ground Effects LED.
@@ -21,6 +21,7 @@
 // rgreen 2009-07-07
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "key.h"
 #include "led.h"
 #include "midi.h"
@@ -31,8 +32,9 @@
 // The menu system.
 //
 // Activate the menu system by holding down the top-left key (key 0) while
-// booting. You will be presented with seven lights on the top row which are
-// he seven options available. More details in the user manual documentation.
+// booting, or at any time by pressing the menu combo. You will be presented
+// with seven lights on the top row which are he seven options available.
+// More details in the user manual documentation.
 //
 // Programming the LEDs and keys for a UI is a little tricky as the key
 // input bits do not match the keyboard layout in the way you might think
@@ -56,12 +58,16 @@
 // To add a bit of visual interest I added a simulated Pulse Wave Modulation
 // (PWM) on some of the LED values. Turning the LEDs on and off quickly
 // makes them appear dimly lit, so we get the effect of varying the LED
-// intensity. The LED is on for two beats and off for the rest of the period.
+// intensity. The LED is on for one millisecond and off for the rest of the
+// period. All the light effects run off the millisecond clock, so they
+// don't change speed with how often the menu is updated.
 //
 // This is pretty much the least well documented code in the entire system,
-// but it's a pretty basic Finite State Machine with a dispatch routine at
-// the top that gets called in an endless loop until the "finished" flag is
-// set by the top level menu. Because if this repeated polling at high
+// but it's a pretty basic Finite State Machine with a dispatch routine,
+// menu_update(), that does one step each time it is called and returns
+// true once the top level menu has been exited. At boot time it is called
+// in a loop of its own, at runtime once per pass of the main loop while
+// USB carries on underneath. Because if this repeated polling at high
 // frequency the menu items should only react to keydown messages.
 //
 // NOTE: persistent values are only written if you exit through the
@@ -88,10 +94,11 @@ typedef enum menu_state {
 // Which menu page is currently active.
 static menu_state g_menu_state = TOP_LEVEL;
 
-// The global flashing light timer and mask. The counter is incremented
-// every time through the menu loop and when it flips over to zero the mask
-// is inverted.  Lights that should be flashing can be ORed into the light
-// state to get the correct flashing effect, e.g.
+// The global flashing light masks, worked out from the millisecond clock.
+// The flash mask is inverted every MENU_FLASH_MS, and the half and dim
+// masks are on for one millisecond in every MENU_HALF_MS and MENU_DIM_MS.
+// Lights that should be flashing can be ORed into the light state to get
+// the correct flashing effect, e.g.
 //
 //     uint16_t fixed = 0x0300;
 //     uint16_t flashing = 0x000C0;
@@ -107,10 +114,13 @@ static menu_state g_menu_state = TOP_LEVEL;
 //
 //  where "*" are fixed, "#" are flashing and "o" are half intensity lights.
 //
+#define MENU_FLASH_MS 256  // All three must be powers of two.
+#define MENU_HALF_MS  4
+#define MENU_DIM_MS   8
+
 static uint16_t dim_mask = 0xffff;
 static uint16_t half_mask = 0xffff;
 static uint16_t flash_mask = 0xffff;
-static uint16_t flash_counter = 4096; // the flash period
 
 // Prototypes ------------------------------------------------------------------
 
@@ -122,6 +132,8 @@ void run_4bit_value(uint8_t *value, const uint16_t menu_item);
 void run_7bit_value(uint8_t *value, const uint16_t menu_item);
 
 void menu(void);
+void menu_start(void);
+bool menu_update(void);
 bool menu_top_level(void);
 void menu_channel(void);
 void menu_velocity(void);
@@ -400,81 +412,79 @@ void run_3value_option(uint8_t *value, uint8_t menu_item)
 }
 
 
+// Run the menu at boot time, until the "menu exit" button has been
+// selected. Once it returns the Midifighter can continue boot up.
+//
+void menu(void)
+{
+    menu_start();
+    do {
+        // Read the key state once before dispatching to the current menu
+        // handler. No other function updates the key state from now on.
+        key_read();
+        key_calc();
+    } while (!menu_update());
+}
+
+// Open the menu at the top level page.
+//
+void menu_start(void)
+{
+    g_menu_state = TOP_LEVEL;
+}
+
 // The main menu dispatcher, sending control to the correct routine
 // depending on which is the currently active menu page (called the
-// "state"). Once it returns the Midifighter can continue boot up.
+// "state"), using the key state last read. Returns true once the menu has
+// been exited.
 //
 // NOTE: values are not written to the EEPROM until we exit the menu through
 // the "exit button". This allows us to panic reset if we screw up.
 //
-void menu(void)
+bool menu_update(void)
 {
     bool finished = false;
 
-    // Loop until the "menu exit" button has been selected.
-    while (!finished) {
-        // Read the key state once before dispatching to the current menu
-        // handler. No other function updates the key state from now on.
-        key_read();
-        key_calc();
+    // update the flashing light and PWM masks.
+    uint16_t ticks = key_ticks();
+    flash_mask = (ticks & MENU_FLASH_MS) ? 0x0000 : 0xffff;
+    half_mask = (ticks & (MENU_HALF_MS - 1)) ? 0x0000 : 0xffff;
+    dim_mask = (ticks & (MENU_DIM_MS - 1)) ? 0x0000 : 0xffff;
 
-        // update the flashing light counter and masks.
-        --flash_counter;
-        if (flash_counter==0) {
-            flash_counter = 4096;
-            flash_mask = ~flash_mask;
-        }
-
-        // Simulate PWM for the dim and half masks.
-        if ((flash_counter & 0x3c) == 0) {
-            half_mask = 0xffff;
-        } else {
-            half_mask = 0x0000;
-        }
-
-        if ((flash_counter & 0x3fc) == 0) {
-            dim_mask = 0xffff;
-        } else {
-            dim_mask = 0x0000;
-        }
-
-
-        // Dispatch control to the current menu page.
-        switch (g_menu_state) {
-        case TOP_LEVEL:
-            finished = menu_top_level();
-            break;
-        case CHANNEL:
-            menu_channel();
-            break;
-        case VELOCITY:
-            menu_velocity();
-            break;
-        case BASENOTE:
-            menu_basenote();
-            break;
-        case KEYPRESS_LED:
-            menu_keypress_led();
-            break;
-        case FOUR_BANKS:
-            menu_fourbanks_mode();
-            break;
-        case READ_DIGITAL:
-            menu_read_digital();
-            break;
-        case READ_ANALOG:
-            menu_read_analog();
-            break;
-        }
+    // Dispatch control to the current menu page.
+    switch (g_menu_state) {
+    case TOP_LEVEL:
+        finished = menu_top_level();
+        break;
+    case CHANNEL:
+        menu_channel();
+        break;
+    case VELOCITY:
+        menu_velocity();
+        break;
+    case BASENOTE:
+        menu_basenote();
+        break;
+    case KEYPRESS_LED:
+        menu_keypress_led();
+        break;
+    case FOUR_BANKS:
+        menu_fourbanks_mode();
+        break;
+    case READ_DIGITAL:
+        menu_read_digital();
+        break;
+    case READ_ANALOG:
+        menu_read_analog();
+        break;
     }
 
-    // We have exited the menu correctly, write the edited values back to
-    // the EEPROM.
-    eeprom_save_edits();
-
-    // Everything done, return to the main loop to finish
-    // bootup.
-    return;
+    if (finished) {
+        // We have exited the menu correctly, write the edited values back
+        // to the EEPROM.
+        eeprom_save_edits();
+    }
+    return finished;
 }
 
 // The first menu page, where each flashing light is one of the menu pages.
@@ -25,5 +25,7 @@
 
 // Run the menu update ------------------
 void menu(void);
+void menu_start(void);
+bool menu_update(void);
 
 #endif // _MENU_H_INCLUDED
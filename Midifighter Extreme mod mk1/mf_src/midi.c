@@ -74,13 +74,17 @@ uint8_t g_midi_channel = 14;      // MIDI channel to listen and send on (0..15)
 uint8_t g_midi_velocity = 74;     // Default velocity for NoteOn (0..127)
 uint8_t g_channel_offset = 0;    // Channel offset for changing channel by global bank
 
-// A copy of the most recent velocity for each MIDI note.
-uint8_t g_midi_note_state[MIDI_MAX_NOTES];
+// Whether the most recent velocity of each MIDI note the LEDs can show was
+// non-zero, a bit per note. The LEDs only need to know which notes are on.
+uint8_t g_midi_note_state[MIDI_LED_NOTES / 8];
 
 // Save a little storage by preallocating and reusing space for the MIDI
 // event packet.
 static MIDI_EventPacket_t midi_event;
 
+// Bytes of a SysEx message waiting in midi_event for a full packet.
+static uint8_t midi_sysex_count = 0;
+
 
 // MIDI functions -------------------------------------------------------------
 
@@ -92,7 +96,24 @@ void midi_setup(void)
 
     // basenote, expnote, channel and velocity have already been set up via
     // the EEPROM settings. Clear the MIDI keystate.
-    memset(g_midi_note_state, 0, MIDI_MAX_NOTES);
+    memset(g_midi_note_state, 0, sizeof(g_midi_note_state));
+}
+
+// Record whether a MIDI note is on in the MIDI keystate. Notes no LED can
+// show aren't kept.
+//
+void midi_note_state_set(const uint8_t note, const bool on)
+{
+    uint8_t relative_note = note - MIDI_BASE_NOTE;
+    if (relative_note >= MIDI_LED_NOTES) {
+        return;
+    }
+    uint8_t bit = 1 << (relative_note & 0x07);
+    if (on) {
+        g_midi_note_state[relative_note >> 3] |= bit;
+    } else {
+        g_midi_note_state[relative_note >> 3] &= ~bit;
+    }
 }
 
 // Append a MIDI note change event (note on or off) to the currently
@@ -146,6 +167,53 @@ void midi_stream_cc(const uint8_t controller, const uint8_t value)
     MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
 }
 
+// Append one byte of a SysEx message to the currently selected USB
+// endpoint. USB-MIDI carries SysEx in packets of three bytes, and the
+// command of the last packet says how many of its bytes are used, so bytes
+// are held in the event packet until it is full or the 0xF7 ends the
+// message. Streaming a message this way needs no buffer for all of it.
+//
+//  byte     The next byte of the message, from the 0xF0 to the 0xF7.
+//
+void midi_stream_sysex_byte(const uint8_t byte)
+{
+    //  Assign this MIDI event to cable 0.
+    const uint8_t midi_virtual_cable = 0;
+
+    switch (midi_sysex_count++) {
+    case 0:
+        midi_event.Data1 = byte;
+        midi_event.Data2 = 0;
+        midi_event.Data3 = 0;
+        break;
+    case 1:
+        midi_event.Data2 = byte;
+        break;
+    default:
+        midi_event.Data3 = byte;
+        break;
+    }
+    if (byte == 0xf7 || midi_sysex_count == 3) {
+        midi_event.CableNumber = midi_virtual_cable << 4;
+        midi_event.Command     = (byte == 0xf7) ? 0x4 + midi_sysex_count : 0x4;
+        MIDI_Device_SendEventPacket(g_midi_interface_info, &midi_event);
+        midi_sysex_count = 0;
+    }
+}
+
+// Append a complete SysEx message, from the 0xF0 to the 0xF7, to the
+// currently selected USB endpoint.
+//
+//  data     The message.
+//  length   Number of bytes in the message.
+//
+void midi_stream_sysex(const uint8_t* data, uint8_t length)
+{
+    while (length--) {
+        midi_stream_sysex_byte(*data++);
+    }
+}
+
 // Convert a note number (relative to the basenote) to an LED number,
 // returning 0xff (high bit set) if the midi note doesn't map to an LED
 // number.
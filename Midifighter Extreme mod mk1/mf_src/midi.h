@@ -48,14 +48,22 @@ extern USB_ClassInfo_MIDI_Device_t* g_midi_interface_info;
 extern uint8_t g_midi_channel;
 extern uint8_t g_midi_velocity;
 
-// a copy of the most recent velocity for each MIDI note.
-extern uint8_t g_midi_note_state[MIDI_MAX_NOTES];
+// A bit for each MIDI note the LEDs can show, from MIDI_BASE_NOTE up, set
+// while its most recent velocity is non-zero.
+#define MIDI_LED_NOTES 64
+extern uint8_t g_midi_note_state[MIDI_LED_NOTES / 8];
+#define MIDI_NOTE_IS_ON(note) \
+    (g_midi_note_state[((note) - MIDI_BASE_NOTE) >> 3] & \
+     (1 << (((note) - MIDI_BASE_NOTE) & 0x07)))
 
 // MIDI function prototypes ----------------------------------------------------
 
 void midi_setup(void);
+void midi_note_state_set(const uint8_t note, const bool on);
 void midi_stream_note(const uint8_t pitch, const bool onoff);
 void midi_stream_cc(const uint8_t controller, const uint8_t value);
+void midi_stream_sysex_byte(const uint8_t byte);
+void midi_stream_sysex(const uint8_t* data, uint8_t length);
 uint8_t midi_note_to_key(const uint8_t notenum);
 uint8_t midi_key_to_note(const uint8_t keynum);
 uint8_t midi_fourbanks_key_to_note(const uint8_t keynum);
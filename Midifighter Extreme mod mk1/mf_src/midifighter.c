@@ -72,6 +72,10 @@
 #endif
 
 #include "mod.h"
+#include "analog.h"
+#include "buttons.h"
+#include "curve.h"
+#include "sysex.h"
 
 // Forward Declarations --------------------------------------------------------
 
@@ -95,32 +99,6 @@ uint8_t lerp(uint8_t high, uint8_t low, uint8_t t)
     return low + (diff >> 8);
 }
 
-uint8_t remap(uint8_t value, uint8_t from, uint8_t to, uint8_t lo, uint8_t hi)
-{
-    // Remap the values in the range [lo..hi] into the values [from..to]
-    // e.g. remap the value in the range 3..124 into values 0..127 with a
-    // dead zone at either end.
-
-    //    d      e
-    // 2  D2=64  E2=124   from, to
-    // 3  D3=0   E3=127    lo, hi
-
-    // =IF(A15 < $D$2 , $D$3 ,
-    //     IF(A15 > $E$2, $E$3,
-    //         $D$3 + FLOOR( FLOOR((A15-$D$2)*($E$3-$D$3),1) / floor($E$2-$D$2,1) ,1)))
-
-    // IF(A15 < from)  lo
-    // IF(A15 > to) hi
-    // else lo +  (A15-from) * (hi-lo) ) / (to-from)
-
-    if (value < from) return lo;
-    if (value > to) return hi;
-    uint16_t numer = (value - from) * (hi - lo);
-    uint16_t denom = (to - from);
-    return (uint8_t)(lo + (numer / denom));
-}
-
-
 // USB Tasks and Events --------------------------------------------------------
 
 // We are in the process of enumerating but not yet ready to generate MIDI.
@@ -206,6 +184,142 @@ void EVENT_USB_Device_UnhandledControlRequest(void)
 //     return true;
 // }
 
+// A preset to switch to once every key is up, so that no note is left
+// hanging on the old channel.
+#define NO_PRESET 0xff
+static uint8_t preset_pending = NO_PRESET;
+
+// Take in the MIDI sent to us.
+//
+// This runs from the main loop next to Midifighter_Task() rather than from
+// inside it, so that a SysEx upload, the deepest call chain in the
+// firmware, doesn't have the task's large stack frame beneath it as well.
+//
+void MIDI_Task(void)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured) {
+        return;
+    }
+
+    // If there is data in the Endpoint for us to read, get a USB-MIDI
+    // packet to process. Endpoint_IsReadWriteAllowed() returns true if
+    // there is data remaining inside an OUT endpoint or if an IN endpoint
+    // has space left to fill. The same function doing two jobs, confusing
+    // but there you are.
+    //
+    // SysEx uploads write a byte of EEPROM for each byte of data, and each
+    // write takes about 3.4ms. A packet is only taken while the EEPROM
+    // write queue has room for all three of its bytes, so eeprom_write()
+    // never has to wait here. Until then the packets stay in the endpoint,
+    // where the USB hardware holds the host off, and the keys, pots and
+    // LEDs carry on as normal.
+    MIDI_EventPacket_t input_event;
+    while (eeprom_write_room() >= 3 &&
+           MIDI_Device_ReceiveEventPacket(g_midi_interface_info,
+                                          &input_event)) {
+        // Assuming all virtual MIDI cables are intended for us, ensure that
+        // this event is being sent on our current MIDI channel.
+        //
+        // The lower 4-bits (".Command") of the USB_MIDI event packet tells
+        // us what kind of data it contains, and whether to expect more data
+        // in the same message. Commands are:
+        //     0x0 = Reserved for Misc
+        //     0x1 = Reserved for Cable events
+        //     0x2 = 2-byte System Common
+        //     0x3 = 3-byte System Common
+        //     0x4 = 3-byte Sysex starts or continues
+        //     0x5 = 1-byte System Common or Sysex ends
+        //     0x6 = 2-byte Sysex ends
+        //     0x7 = 3-byte Sysex ends
+        //     0x8 = Note On
+        //     0x9 = Note Off
+        //     0xA = Poly KeyPress
+        //     0xB = Control Change (CC)
+        //     0xC = Program Change
+        //     0xD = Channel Pressure
+        //     0xE = PitchBend Change
+        //     0xF = 1-byte message
+
+        // SysEx comes in packets of up to three bytes and has no channel.
+        // The mod's SysEx commands are handled in sysex.c.
+        if (input_event.Command >= 0x4 && input_event.Command <= 0x7) {
+            uint8_t length = (input_event.Command == 0x4) ? 3 : input_event.Command - 0x4;
+            sysex_receive(input_event.Data1);
+            if (length > 1) sysex_receive(input_event.Data2);
+            if (length > 2) sysex_receive(input_event.Data3);
+            continue;
+        }
+
+        // System Real Time events don't have a channel, so we check for
+        // them first.
+        if (input_event.Command == 0xF) {
+            if (input_event.Data1 == 0xF8) {
+                // Clock event, increment the counter.
+                g_led_groundfx_counter++;
+            } else if (input_event.Data1 == 0xFA) {
+                // Song Start, reset the counter.
+                g_led_groundfx_counter = 0;
+            } else if (input_event.Data1 == 0xFC) {
+                // Song Stop event, reset the counter.
+                g_led_groundfx_counter = 0;
+            }
+        }
+
+        // Now we can check that the MIDI channel is the one we're payin
+        // attention to before parsing the event.
+        uint8_t channel = input_event.Data1 & 0x0f;
+        if (channel == g_midi_channel) {
+            // Work out the valid range of MIDI notes we will accept.
+            uint8_t highest_note = MIDI_BASE_NOTE + 16;
+            if (g_key_fourbanks_mode == FOURBANKS_INTERNAL) {
+                highest_note = MIDI_BASE_NOTE + 48;
+            } else if (g_key_fourbanks_mode == FOURBANKS_EXTERNAL) {
+                highest_note = MIDI_BASE_NOTE + 64;
+            }
+            // Check to see if we have a NoteOn or NoteOff event.
+            switch (input_event.Command) {
+            case 0x9 : {
+                    // A NoteOn event was found, so update the MIDI
+                    // keystate with the note velocity (which may be
+                    // zero).
+                    uint8_t note = input_event.Data2;
+                    uint8_t velocity = input_event.Data3;
+                    // Check to see if this note is one we need to care
+                    // about.
+                    if (note >= MIDI_BASE_NOTE &&
+                        note < MIDI_BASE_NOTE + highest_note) {
+                        // record whether the note is on in the MIDI note state
+                        midi_note_state_set(note, velocity > 0);
+                    }
+                }
+                break;
+            case 0x8 : {
+                    // A NoteOff event, so record a zero in the MIDI
+                    // keystate. Yes, a noteoff can have a "velocity",
+                    // but we're relying on the keystate to be zero when
+                    // we have a noteoff, otherwise the LEDs won't match
+                    // the state when we come to calculate them.
+                    uint8_t note = input_event.Data2;
+                    // Check to see if the note is one we need to care
+                    // about.
+                    if (note >= MIDI_BASE_NOTE &&
+                        note < MIDI_BASE_NOTE + highest_note) {
+                        // record the note as off in the MIDI note state
+                        midi_note_state_set(note, false);
+                    }
+                }
+                break;
+            case 0xC :
+                // A Program Change selects a settings preset.
+                if (input_event.Data2 < NUM_PRESETS) {
+                    preset_pending = input_event.Data2;
+                }
+                break;
+            }  // end switch on command
+        } // end channel test
+    } // end while
+}
+
 // The MIDI processing task.
 //
 // Read the buttons and expansion ports to generate MIDI notes. This routine
@@ -222,12 +336,12 @@ void Midifighter_Task(void)
 
     // Overview
     // --------
-    // The state of all the active notes is kept in an array of bytes
-    // recording the most recent velocity of the note. A nonzero velocity is
-    // a NoteOn and a zero velocity is a NoteOff. We update the keystate
-    // from the outside world first, from the keyboard second, from the
-    // expansion port third and generate LEDs from the resulting table at
-    // the end.
+    // The state of all the active notes is kept in an array of bits
+    // recording whether the most recent velocity of the note was nonzero.
+    // A nonzero velocity is a NoteOn and a zero velocity is a NoteOff. We
+    // update the keystate from the outside world first, from the keyboard
+    // second, from the expansion port third and generate LEDs from the
+    // resulting table at the end.
     //
     // Midi Map
     // --------
@@ -325,101 +439,32 @@ void Midifighter_Task(void)
 
 
 
-    // INPUT MIDI from USB -----------------------------------------------------
+    // Opening the menu waits until every key is up, like switching
+    // presets, and the menu is then run from here while it's open.
+    static bool menu_pending = false;
+    static bool menu_active = false;
+    // The analog inputs read when the menu was opened.
+    static uint8_t menu_analog_read;
 
-    // If there is data in the Endpoint for us to read, get a USB-MIDI
-    // packet to process. Endpoint_IsReadWriteAllowed() returns true if
-    // there is data remaining inside an OUT endpoint or if an IN endpoint
-    // has space left to fill. The same function doing two jobs, confusing
-    // but there you are.
-    MIDI_EventPacket_t input_event;
-    while (MIDI_Device_ReceiveEventPacket(g_midi_interface_info,
-                                          &input_event)) {
-        // Assuming all virtual MIDI cables are intended for us, ensure that
-        // this event is being sent on our current MIDI channel.
-        //
-        // The lower 4-bits (".Command") of the USB_MIDI event packet tells
-        // us what kind of data it contains, and whether to expect more data
-        // in the same message. Commands are:
-        //     0x0 = Reserved for Misc
-        //     0x1 = Reserved for Cable events
-        //     0x2 = 2-byte System Common
-        //     0x3 = 3-byte System Common
-        //     0x4 = 3-byte Sysex starts or continues
-        //     0x5 = 1-byte System Common or Sysex ends
-        //     0x6 = 2-byte Sysex ends
-        //     0x7 = 3-byte Sysex ends
-        //     0x8 = Note On
-        //     0x9 = Note Off
-        //     0xA = Poly KeyPress
-        //     0xB = Control Change (CC)
-        //     0xC = Program Change
-        //     0xD = Channel Pressure
-        //     0xE = PitchBend Change
-        //     0xF = 1-byte message
 
-        // System Real Time events don't have a channel, so we check for
-        // them first.
-        if (input_event.Command == 0xF) {
-            if (input_event.Data1 == 0xF8) {
-                // Clock event, increment the counter.
-                g_led_groundfx_counter++;
-            } else if (input_event.Data1 == 0xFA) {
-                // Song Start, reset the counter.
-                g_led_groundfx_counter = 0;
-            } else if (input_event.Data1 == 0xFC) {
-                // Song Stop event, reset the counter.
-                g_led_groundfx_counter = 0;
-            }
-        }
+    // Run the MENU ------------------------------------------------------------
 
-        // Now we can check that the MIDI channel is the one we're payin
-        // attention to before parsing the event.
-        uint8_t channel = input_event.Data1 & 0x0f;
-        if (channel == g_midi_channel) {
-            // Work out the valid range of MIDI notes we will accept.
-            uint8_t highest_note = MIDI_BASE_NOTE + 16;
-            if (g_key_fourbanks_mode == FOURBANKS_INTERNAL) {
-                highest_note = MIDI_BASE_NOTE + 48;
-            } else if (g_key_fourbanks_mode == FOURBANKS_EXTERNAL) {
-                highest_note = MIDI_BASE_NOTE + 64;
+    // While the menu is open it has the keys and LEDs to itself and no MIDI
+    // is sent, but USB keeps running and MIDI keeps coming in underneath.
+    if (menu_active) {
+        key_read();
+        key_calc();
+        if (menu_update()) {
+            menu_active = false;
+            g_key_bank_selected = 0;
+            // Pots on analog inputs turned on in the menu haven't had their
+            // noise measured, so measure them all again.
+            if (g_exp_analog_read != menu_analog_read) {
+                analog_measure_noise();
             }
-            // Check to see if we have a NoteOn or NoteOff event.
-            switch (input_event.Command) {
-            case 0x9 : {
-                    // A NoteOn event was found, so update the MIDI
-                    // keystate with the note velocity (which may be
-                    // zero).
-                    uint8_t note = input_event.Data2;
-                    uint8_t velocity = input_event.Data3;
-                    // Check to see if this note is one we need to care
-                    // about.
-                    if (note >= MIDI_BASE_NOTE &&
-                        note < MIDI_BASE_NOTE + highest_note) {
-                        // record the note velocity in the MIDI note state
-                        g_midi_note_state[note] = velocity;
-                    }
-                }
-                break;
-            case 0x8 : {
-                    // A NoteOff event, so record a zero in the MIDI
-                    // keystate. Yes, a noteoff can have a "velocity",
-                    // but we're relying on the keystate to be zero when
-                    // we have a noteoff, otherwise the LEDs won't match
-                    // the state when we come to calculate them.
-                    uint8_t note = input_event.Data2;
-                    // Check to see if the note is one we need to care
-                    // about.
-                    if (note >= MIDI_BASE_NOTE &&
-                        note < MIDI_BASE_NOTE + highest_note) {
-                        // record a zero note velocity in the MIDI note state
-                        g_midi_note_state[note] = 0;
-                    }
-                }
-                break;
-            }  // end switch on command
-        } // end channel test
-    } // end while
+        }
+        return;
+    }
 
 
     // OUTPUT events from the EXPANSION ports ----------------------------------
@@ -450,13 +495,13 @@ void Midifighter_Task(void)
                     midi_stream_note(MIDI_DIGITAL_NOTE + i, true);
                     // Record the note in the MIDI state so we can generate LEDs
                     // from it later.
-                    g_midi_note_state[MIDI_DIGITAL_NOTE + i] = g_midi_velocity;
+                    midi_note_state_set(MIDI_DIGITAL_NOTE + i, g_midi_velocity > 0);
                 }
                 if (keyup & 1) {
                     // There's a key up, insert a NoteOff
                     midi_stream_note(MIDI_DIGITAL_NOTE + i, false);
                     // Record the note in the MIDI state.
-                    g_midi_note_state[MIDI_DIGITAL_NOTE + i] = 0;
+                    midi_note_state_set(MIDI_DIGITAL_NOTE + i, false);
                 }
             }
             allow_read >>= 1;
@@ -484,57 +529,12 @@ void Midifighter_Task(void)
     uint8_t midifighter_bank_up = 0;
     uint8_t midifighter_bank_down = 0;
     
-	// Run the extension mod code if any analog pin is enabled
-    if (g_exp_analog_read) {
-        // Read the full 10-bit value from each ADC channel. NOTE: We tried
-        // averaging multiple reads of the ADC but found that the data was
-        // good enough to use with only a single read.
-
-		DDRD |= EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2 + EXP_DIGITAL3;
-		PORTD |= EXP_DIGITAL0 + EXP_DIGITAL1 + EXP_DIGITAL2 + EXP_DIGITAL3;
-        #define SELECT_MULTIPLEXER_PIN(x) PORTD = (((x) << 2) | EXP_DIGITAL3)
-        
-		uint8_t adc_buttons[NUM_ANALOG_BUTTONS];
-		
-		// Zero analog values before sampling
-		uint8_t idx = -1;
-		for (uint8_t i=0; i<NUM_ANALOG_PINS; ++i) {
-			for (uint8_t analogpin = 0; analogpin < 4; ++analogpin) {
-				adc_value[++idx] = 0;
-			}
-		}
-		
-		// Read the full 10-bit value from each ADC channel. Take the
-        // average of several samples to smooth out the noise.
-		for (uint8_t samples=0; samples < 4; ++samples) {
-			// read analog inputs
-			idx = -1;
-			for (uint8_t i=0; i<NUM_ANALOG_PINS; ++i) {
-				SELECT_MULTIPLEXER_PIN(i);
-				for (uint8_t analogpin = 0; analogpin < 4; ++analogpin) {
-					adc_value[++idx] += adc_read(analogpin);
-				}
-			}
-		}
-		idx = -1;
-		// Average the analog values
-		for (uint8_t i=0; i<NUM_ANALOG_PINS; ++i) {
-			for (uint8_t analogpin = 0; analogpin < 4; ++analogpin) {
-				adc_value[++idx] >>= 2;
-			}
-		}
-		
-		// read analog buttons
-		idx = -1;
-		for (uint8_t i=3; i<8; ++i) {
-			SELECT_MULTIPLEXER_PIN(i);
-			for (uint8_t analogpin = 0; analogpin < 4; ++analogpin) {
-				adc_buttons[++idx] = (uint8_t)(adc_read(analogpin) >> 2);
-			}
-		}
-        SELECT_MULTIPLEXER_PIN(0);
+	// Run the extension mod code if any analog pin is enabled, each time
+	// the background scan completes a frame. The scan only does a few
+	// conversions per pass, so the keys below never wait for it.
+    if (g_exp_analog_read && analog_poll()) {
 
-        static bool prev_button_state[NUM_ANALOG_BUTTONS] = {false,};
+        static uint32_t prev_button_state = 0;
 		// Row 4+
         #define ANALOG_BUTTONS_BASE_NOTE   12
 		// Row 3
@@ -547,44 +547,48 @@ void Midifighter_Task(void)
         shift_button = 0;
         
         // Determine if shift button (pin 5, multiplexer 1) is pressed down
-        if (adc_buttons[SHIFT_BUTTON] < 0x20) {
+        uint32_t buttons = g_button_state;
+        #define FOUR_BUTTONS (BUTTON(0) | BUTTON(1) | BUTTON(2) | BUTTON(3))
+        #define HELD(mask) ((buttons & (mask)) == (mask))
+        if (buttons & BUTTON(SHIFT_BUTTON)) {
             shift_button = 1;
 			
 			// Test for demo mode (shift + four buttons + global 4
 			if (!demo_mode) {
 				// If the correct buttons are pressed, switch into demo mode
-				if (adc_buttons[0] < 0x20 && adc_buttons[1] < 0x20 && adc_buttons[2] < 0x20 &&  adc_buttons[3] < 0x20 && adc_buttons[12] < 0x20) {
+				if (HELD(FOUR_BUTTONS | BUTTON(12))) {
 					demo_mode = 1;
 				}
 			} else {
 				// If the correct buttons are pressed, switch out of demo mode
-				if (adc_buttons[0] < 0x20 && adc_buttons[1] < 0x20 && adc_buttons[2] < 0x20 &&  adc_buttons[3] < 0x20 && adc_buttons[15] < 0x20) {
+				if (HELD(FOUR_BUTTONS | BUTTON(15))) {
 					demo_mode = 0;
 				}
 			}
+
+			// Shift + four buttons + global 3 starts calibrating the pots.
+			// Sweep each one end to end, then shift + four buttons +
+			// global 2 saves their ranges.
+			if (HELD(FOUR_BUTTONS)) {
+				if (buttons & BUTTON(13)) {
+					analog_calibrate_start();
+				} else if (buttons & BUTTON(14)) {
+					analog_calibrate_finish();
+				}
+			}
         } 
 		
         // Set midi channel to global bank.
         midi_set_bank(global_bank);
         // Handle analog buttons
         for (uint8_t i=0; i<NUM_ANALOG_BUTTONS; ++i) {
-            bool state_change = false;
-            bool button_state = false;
-        
-            // determine if the buttons state has changed            
-            if (adc_buttons[i] > 0x38 && prev_button_state[i]) {
-                state_change = true;
-                button_state = false;
-            } else if (adc_buttons[i] < 0x08 && !prev_button_state[i]) {
-                state_change = true;
-                button_state = true;
-            }
+            // determine if the buttons state has changed, the decoder
+            // has already debounced it
+            bool state_change = (buttons ^ prev_button_state) & BUTTON(i);
+            bool button_state = buttons & BUTTON(i);
             
             // If the button state has changed, emit a note
             if (state_change) {
-                // save the state so we can detect transitions later
-                prev_button_state[i] = button_state;
-                
                 // generic buttons
                 if (i < NUM_GENERAL_ANALOG_BUTTONS) {
                     if (i == SHIFT_BUTTON) {
@@ -634,6 +638,8 @@ void Midifighter_Task(void)
             }
             
         }
+        // save the state so we can detect transitions next frame
+        prev_button_state = buttons;
         
         // Global bank button was pressed
         if (global_bank_press) {
@@ -653,35 +659,24 @@ void Midifighter_Task(void)
         midi_set_bank(shift_bank);
 
         // Next, check the ADC values to see if they have changed.
+        uint8_t changes = analog_take_changes();
         for (uint8_t i=0; i<NUM_ANALOG; ++i) {
 
-			// Make sure any change in the value is due to
-			// user action and not sampling noise. We do this by making sure the
-			// value has changed by a minimum amount before we say it has
-			// changed - essentially adding a small amount of Hysteresis into
-			// the system.
-			
-            // Need a signed value for the difference
-            int16_t difference = adc_value[i] - g_exp_analog_prev[i];
-            // If the difference is less than four bits either way we
-            // assume the difference was noise and the ADC was not changed.
-            if (abs(difference) < 8) {
-                adc_value[i] = g_exp_analog_prev[i];
-            }
-	    
-            // Next, check the ADC values to see if they have changed.
+			// The background scan has already filtered the value and held
+			// it at the last one reported unless it has moved out of the
+			// pot's noise band, so any change here is due to user action.
+			// Pots that haven't reported a new value are skipped.
+			if (!(changes & (1 << i))) continue;
 
-            // Lose the bottom three bits of each 10-bit ADC value,
-            // converting it to a 7-bit CC value.
-            uint8_t value = (uint8_t)(adc_value[i] >> 3);
-            uint8_t prev_value = (uint8_t)(g_exp_analog_prev[i] >> 3);
+            // Map each 10-bit ADC value onto a 7-bit position across the
+            // pot's calibrated range and shape it with the pot's curve.
+            uint8_t value = analog_shaped(i, adc_value[i]);
+            uint8_t prev_value = g_exp_analog_prev[i];
 
-            // Compare the CC value to the previous one sent. If there has
-            // been a change, generate the three new MIDI events.
+            // Compare the position to the previous one sent. If there has
+            // been a change, generate the new MIDI events.
             if (value != prev_value) {
 
-                const uint8_t NOTEON_LOW = 3;
-                const uint8_t NOTEON_HIGH = 127 - NOTEON_LOW;
                 const uint8_t MIDI_ANALOG_NOTE = 100;
                 const uint8_t MIDI_ANALOG_CC = 16;
 				const uint8_t CC_OFFSET = 102 - MIDI_ANALOG_CC;
@@ -691,63 +686,38 @@ void Midifighter_Task(void)
                 uint8_t note_a = MIDI_ANALOG_NOTE + 2*i;
                 uint8_t note_b = MIDI_ANALOG_NOTE + 2*i + 1;
 
-                // New mapping style:
-                //
-                //   0  3             64           124 127
-                //   |--|-------------|-------------|--|   - full range
-                //
-                //      |0=======================127|      - CC A
-                //                    |0=========105|      - CC B
-                //
-                //   |__|on____________________________|   - note A
-                //   |off___________________________|on|   - note B
-                //      3                          124
-
-                if (value >= NOTEON_LOW && value <= NOTEON_HIGH) {
-
-                    // 1. Generate the default CC event.
-                    midi_stream_cc(cc_a, remap(value, NOTEON_LOW,NOTEON_HIGH, 0,127));
-
-                    // 2. If the value is in the range 50%-100%, output the
-                    // second CC range.
-                    static uint8_t second_cc_value = 0;
-                    if (value >= 64) {
-                        second_cc_value = remap(value, 64,NOTEON_HIGH, 0,105);
-                        midi_stream_cc(cc_b, second_cc_value);
-                    } else {
-                        // Make sure we zero the second CC value when we
-                        // enter the lower range.
-                        if (second_cc_value > 0) {
-                            second_cc_value = 0;
-                            midi_stream_cc(cc_b, second_cc_value);
-                        }
-                    }
+                // Look up both CCs and both note states for the old and new
+                // positions, see curve_smart_knob[] in curve.c for the
+                // mapping, and send whatever changed.
+                uint8_t a = pgm_read_byte(&curve_smart_knob[value][0]);
+                uint8_t b = pgm_read_byte(&curve_smart_knob[value][1]);
+                uint8_t prev_a = pgm_read_byte(&curve_smart_knob[prev_value][0]);
+                uint8_t prev_b = pgm_read_byte(&curve_smart_knob[prev_value][1]);
+
+                // 1. The default CC and 2. the second CC over the range
+                // 50%-100%.
+                if ((a ^ prev_a) & 0x7f) {
+                    midi_stream_cc(cc_a, a & 0x7f);
+                }
+                if ((b ^ prev_b) & 0x7f) {
+                    midi_stream_cc(cc_b, b & 0x7f);
+                }
 
+                // 3. A Note event if we have just entered or left the top or
+                //    bottom tick of the range.
+                if ((a ^ prev_a) & 0x80) {
+                    bool on = a & 0x80;
+                    midi_stream_note(note_a, on);
+                    midi_note_state_set(note_a, on && g_midi_velocity > 0);
                 }
-                // 3. Generate a Note event if we have just entered or left
-                //    the top or bottom tick of the range. Values turn on as
-                //    we leave the bottom or enter the top:
-                //
-                //   |off|on----------------------------| note A
-                //   |off----------------------------|on| note B
-                //
-                if (value >= NOTEON_LOW && prev_value < NOTEON_LOW) {
-                    midi_stream_note(note_a, true);
-                    g_midi_note_state[note_a] = g_midi_velocity;
-                } else if (value < NOTEON_LOW && prev_value >= NOTEON_LOW) {
-                    midi_stream_note(note_a, false);
-                    g_midi_note_state[note_a] = 0;
-
-                } else if (value >= NOTEON_HIGH && prev_value < NOTEON_HIGH) {
-                    midi_stream_note(note_b, true);
-                    g_midi_note_state[note_b] = g_midi_velocity;
-                } else if (value < NOTEON_HIGH && prev_value >= NOTEON_HIGH) {
-                    midi_stream_note(note_b, false);
-                    g_midi_note_state[note_b] = 0;
+                if ((b ^ prev_b) & 0x80) {
+                    bool on = b & 0x80;
+                    midi_stream_note(note_b, on);
+                    midi_note_state_set(note_b, on && g_midi_velocity > 0);
                 }
 
-                // Record the new ADC value for next time through.
-                g_exp_analog_prev[i] = adc_value[i];
+                // Record the new position for next time through.
+                g_exp_analog_prev[i] = value;
             }
         }
     }
@@ -904,6 +874,12 @@ void Midifighter_Task(void)
         case COMBO_E_RELEASE:
             midi_stream_note(12, false);
             break;
+        case COMBO_PRESET_NEXT:
+            preset_pending = (g_preset + 1) % NUM_PRESETS;
+            break;
+        case COMBO_MENU:
+            menu_pending = true;
+            break;
         default:
             // do nothing.
             break;
@@ -916,6 +892,21 @@ void Midifighter_Task(void)
     // Finished generating MIDI events, flush the endpoints.
     MIDI_Device_Flush(g_midi_interface_info);
 
+    // Switch presets now that the note offs for the old one have gone out.
+    if (preset_pending != NO_PRESET && g_key_state == 0 && g_button_state == 0) {
+        eeprom_preset_load(preset_pending);
+        preset_pending = NO_PRESET;
+    }
+
+    // Likewise open the menu once its combo has been let go.
+    if (menu_pending && g_key_state == 0 && g_button_state == 0) {
+        menu_pending = false;
+        menu_active = true;
+        menu_analog_read = g_exp_analog_read;
+        menu_start();
+        return;
+    }
+
 
     // Update the LEDs ---------------------------------------------------------
 
@@ -926,10 +917,9 @@ void Midifighter_Task(void)
         // Normal display
         // --------------
         // Update the 16 LEDs with the current midi state. Loop over the
-        // MIDI keystate array and set an LED bit if that MIDI note has a
-        // velocity greater than zero.
+        // MIDI keystate and set an LED bit if that MIDI note is on.
         for (uint8_t i=MIDI_BASE_NOTE; i<MIDI_BASE_NOTE + 16; ++i) {
-            if (g_midi_note_state[i] > 0) {
+            if (MIDI_NOTE_IS_ON(i)) {
                 leds |= 1 << midi_note_to_key(i);
             }
         }
@@ -952,7 +942,7 @@ void Midifighter_Task(void)
         // bank.
         uint8_t basenote = MIDI_BASE_NOTE + (g_key_bank_selected * 12);
         for (uint8_t i=basenote; i<basenote + 12; ++i) {
-            if (g_midi_note_state[i] > 0) {
+            if (MIDI_NOTE_IS_ON(i)) {
                 leds |= 1 << midi_fourbanks_note_to_key(i);
             }
         }
@@ -999,7 +989,7 @@ void Midifighter_Task(void)
         // set the LED on each key that has a non-zero MIDI state.
         uint8_t basenote = MIDI_BASE_NOTE + (g_key_bank_selected * 16);
         for (uint8_t i=basenote; i<basenote + 16; ++i) {
-            if (g_midi_note_state[i] > 0) {
+            if (MIDI_NOTE_IS_ON(i)) {
                 leds |= 1 << midi_fourbanks_note_to_key(i);
             }
         }
@@ -1048,7 +1038,7 @@ int main(void)
     // (You'll find this function in winavr/avr/include/avr/power.h)
     clock_prescale_set(clock_div_1);
 
-	spi_install_slave(SPI_SLAVE_PIC, SPI_PORT_D, PIC_SELECT, SPI_LOW_TO_SELECT);
+	mod_setup();  // register the PIC co-processor on the SPI bus.
 	
     // Start up the subsystems.
     eeprom_setup();   // setup global settings from the EEPROM
@@ -1099,6 +1089,9 @@ int main(void)
         // Reenable the watchdog timer.
         //wdt_enable(WDTO_15MS);
 
+        // Let any settings still being saved reach the EEPROM.
+        eeprom_flush();
+
         // turn off the key debounce interrupt. If we don't do this then as
         // the bootloader is trying to set up it's state the timer interrupt
         // will be firing and jumping to the reset vector 1000 times a
@@ -1165,6 +1158,19 @@ int main(void)
         menu();
     }
 	
+    // Load the pot calibration, after any factory reset in the menu.
+    analog_setup();
+
+    // Start each pot from the position it is resting at, so nothing is
+    // sent for it until it moves.
+    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
+        g_exp_analog_prev[i] = analog_shaped(i, adc_value[i]);
+    }
+#ifdef COMBO
+    // Load the combo table, uploaded or built-in.
+    combo_load();
+#endif
+
     // Start up USB system now that everything else is safely squared away
     // and our globals are setup.
     USB_Init();
@@ -1174,12 +1180,21 @@ int main(void)
 
     // Indicate USB not ready.
     led_set_state(0x0001);
+
+    // From here on SPI clients get a fixed share of the bus per millisecond.
+    spi_scheduler_enable();
 	
     // Enter an endless loop.
     for(;;) {
+        // Take in any MIDI the host has sent.
+        MIDI_Task();
+
         // Read keys and expansion port to check for MIDI events to send and
         // LEDs to set.
         Midifighter_Task();
+
+        // Send any LED or PIC frames that were waiting for bus time.
+        spi_service();
         
         // Let the LUFA MIDI Device drivers have a go.
         MIDI_Device_USBTask(g_midi_interface_info);
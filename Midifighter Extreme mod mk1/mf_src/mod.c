@@ -10,6 +10,7 @@
 #include "key.h"
 #include "spi.h"
 #include "led.h"
+#include "constants.h"
 
 // Globals
 
@@ -46,6 +47,126 @@ char demo[max] PROGMEM = {
 	0x00, 0x40, 0x00,	0x00, 0x80, 0x00};
 
 char* cycle = demo;
+
+// The LED state frame last handed to the SPI bus scheduler, and whether it
+// is still waiting to be sent to the PIC. Its payload starts out invalid
+// so that the first state is always sent.
+static volatile uint8_t pic_frame[PIC_FRAME_SIZE] = {PIC_CMD_LEDS, 0xff};
+static volatile bool pic_frame_pending = false;
+
+// When the LED state was last handed over, so that unchanged state isn't
+// sent again until a refresh is due.
+static uint16_t pic_state_tick = 0;
+
+// Brightness of each external LED and a bit for each one the PIC hasn't
+// been told about yet. The bit after the last LED is a PIC_ALL_LEDS frame,
+// which is always sent first as it was set before any of the others.
+#define PIC_BRIGHTNESS_ALL ((uint32_t)1 << NUM_EXTERNAL_LEDS)
+static uint8_t pic_brightness[NUM_EXTERNAL_LEDS];
+static uint32_t pic_brightness_dirty = 0;
+
+// Send one 5 byte frame to the PIC.
+static void pic_send_frame (uint8_t command, uint8_t payload_0, uint8_t payload_1, uint8_t payload_2)
+{
+	spi_transmit(command);
+	spi_transmit(payload_0);
+	spi_transmit(payload_1);
+	spi_transmit(payload_2);
+	spi_transmit((command ^ payload_0 ^ payload_1 ^ payload_2) & 0x7f);
+}
+
+// Send the next pending frame to the PIC. Called by the SPI bus scheduler
+// with the PIC selected. The LED state goes first, then any brightness
+// changes one frame at a time so a burst of them can't hog the bus.
+static uint8_t pic_flush (void)
+{
+	if (pic_frame_pending) {
+		pic_frame_pending = false;
+		for (uint8_t i=0; i < PIC_FRAME_SIZE; ++i) {
+			spi_transmit(pic_frame[i]);
+		}
+	} else if (pic_brightness_dirty & PIC_BRIGHTNESS_ALL) {
+		pic_brightness_dirty &= ~PIC_BRIGHTNESS_ALL;
+		pic_send_frame(PIC_CMD_BRIGHTNESS, PIC_ALL_LEDS, pic_brightness[0], 0);
+	} else if (pic_brightness_dirty) {
+		uint8_t led = 0;
+		while (!(pic_brightness_dirty & ((uint32_t)1 << led))) {
+			++led;
+		}
+		pic_brightness_dirty &= ~((uint32_t)1 << led);
+		pic_send_frame(PIC_CMD_BRIGHTNESS, led, pic_brightness[led], 0);
+	} else {
+		return 0;
+	}
+
+	// Come back for whatever is left.
+	if (pic_frame_pending || pic_brightness_dirty) {
+		spi_post(SPI_SLAVE_PIC);
+	}
+	return PIC_FRAME_SIZE;
+}
+
+// Hand a new LED state to the bus scheduler if it differs from the last one
+// sent, or if a refresh is due. Only the latest state matters to the PIC,
+// so a frame that hasn't been sent yet is simply replaced.
+static void pic_post (uint8_t byte_1, uint8_t byte_2, uint8_t byte_3)
+{
+	// Repack the 17 LED bits into 7-bit payload bytes.
+	uint8_t payload_0 = byte_1 & 0x7f;
+	uint8_t payload_1 = (byte_1 >> 7) | ((byte_2 & 0x3f) << 1);
+	uint8_t payload_2 = (byte_2 >> 6) | ((byte_3 & 0x01) << 2);
+
+	uint16_t now = key_ticks();
+	if (payload_0 == pic_frame[1] && payload_1 == pic_frame[2] && payload_2 == pic_frame[3] &&
+	    (uint16_t)(now - pic_state_tick) < PIC_REFRESH_TICKS) {
+		return;
+	}
+	pic_state_tick = now;
+
+	pic_frame[0] = PIC_CMD_LEDS;
+	pic_frame[1] = payload_0;
+	pic_frame[2] = payload_1;
+	pic_frame[3] = payload_2;
+	pic_frame[4] = (PIC_CMD_LEDS ^ payload_0 ^ payload_1 ^ payload_2) & 0x7f;
+	pic_frame_pending = true;
+	spi_post(SPI_SLAVE_PIC);
+}
+
+// Set how bright an external LED (0 to NUM_EXTERNAL_LEDS - 1, or
+// PIC_ALL_LEDS for every one) is when lit, from 0 to 127. The PIC does the
+// dimming itself, so this only costs a frame on the bus when the value
+// actually changes. Set over SysEx, see sysex.h.
+void set_external_led_brightness (uint8_t led, uint8_t brightness)
+{
+	brightness &= 0x7f;
+	if (led == PIC_ALL_LEDS) {
+		// One frame does for every LED, and replaces any still waiting.
+		for (uint8_t i=0; i < NUM_EXTERNAL_LEDS; ++i) {
+			pic_brightness[i] = brightness;
+		}
+		pic_brightness_dirty = PIC_BRIGHTNESS_ALL;
+		spi_post(SPI_SLAVE_PIC);
+		return;
+	}
+	if (led >= NUM_EXTERNAL_LEDS) return;
+	if (pic_brightness[led] == brightness) return;
+	pic_brightness[led] = brightness;
+	pic_brightness_dirty |= (uint32_t)1 << led;
+	spi_post(SPI_SLAVE_PIC);
+}
+
+// Register the PIC co-processor on the SPI bus.
+void mod_setup ()
+{
+	spi_install_slave(SPI_SLAVE_PIC, SPI_PORT_D, PIC_SELECT, SPI_LOW_TO_SELECT);
+	spi_configure_slave(SPI_SLAVE_PIC, SPI_CLOCK_PIC, SPI_MODE_0);
+	spi_install_client(SPI_SLAVE_PIC, SPI_PRIORITY_PIC, SPI_BUDGET_PIC_US, pic_flush);
+
+	// The PIC starts up with every LED at full brightness.
+	for (uint8_t i=0; i < NUM_EXTERNAL_LEDS; ++i) {
+		pic_brightness[i] = 0x7f;
+	}
+}
 	
 void set_external_leds ()
 {	
@@ -57,11 +178,7 @@ void set_external_leds ()
 		
 		if (prev != (mf_or_pic & 0xf0)) {
 			// Blank LEDs
-			spi_select(SPI_SLAVE_PIC);
-			spi_transmit(0);
-			spi_transmit(0);
-			spi_transmit(0);
-			spi_select_none();
+			pic_post(0, 0, 0);
 			led_set_state((uint16_t)0);
 		}
 		
@@ -70,11 +187,9 @@ void set_external_leds ()
 			led_set_state((byte_1 << 8) | byte_2);
 		} else {
 			// Light PIC LEDs
-			spi_select(SPI_SLAVE_PIC);
-			spi_transmit(byte_1); // global bank, buttons
-			spi_transmit(byte_2); // shift bank, bank
-			spi_transmit(mf_or_pic & 0x0f); // N/A , shift_button
-			spi_select_none();
+			pic_post(byte_1,             // global bank, buttons
+			         byte_2,             // shift bank, bank
+			         mf_or_pic & 0x0f);  // N/A , shift_button
 		}
 		_delay_ms(100);
 		prev = mf_or_pic & 0xf0;
@@ -83,10 +198,8 @@ void set_external_leds ()
 		
 	} else {	
 		// Send LED states to PIC
-		spi_select(SPI_SLAVE_PIC);
-		spi_transmit(((1 << global_bank) << 4) | static_button_state); // global bank, buttons
-		spi_transmit(((1 << shift_bank) << 4) | (1 << midifighter_bank)); // shift bank, bank
-		spi_transmit(shift_button); // N/A , shift_button
-		spi_select_none();
+		pic_post(((1 << global_bank) << 4) | static_button_state,    // global bank, buttons
+		         ((1 << shift_bank) << 4) | (1 << midifighter_bank), // shift bank, bank
+		         shift_button);                                       // N/A , shift_button
 	}
 }
@@ -7,11 +7,14 @@
 
 // Configuration
 
-// Number of multiplexer pins to use for analog inputs. Valid values: 1, 2 and 3
-// Four inputs per pin, so max of 12 inputs
+// The factory channel map: pots on the first NUM_ANALOG_PINS multiplexer
+// pins and buttons on the pins from ANALOG_BUTTON_MUX up. Four inputs per
+// pin. The map in the EEPROM can be changed over SysEx.
 #define NUM_ANALOG_PINS 2
+#define ANALOG_BUTTON_MUX 3
 
-// analog buttons (12 general + 4 midifighter external banks + 4 global banks)
+// analog buttons (12 general + 4 midifighter external banks + 4 global banks),
+// also the most buttons the channel map can have
 #define NUM_ANALOG_BUTTONS 20
 
 // enabled general purpose analog buttons
@@ -24,6 +27,30 @@
 // Number of external (ie, external to the midifighter pcb) leds
 #define NUM_EXTERNAL_LEDS 17
 
+// PIC LED protocol. Each frame is a command byte, the only kind of byte on
+// the wire with the top bit set, followed by 7-bit payload bytes and a
+// 7-bit XOR checksum of the command and payload. The PIC starts a new frame
+// on every command byte, so a lost byte costs one frame and nothing more.
+//
+// PIC_CMD_LEDS carries the on/off state of the 17 external LEDs, numbered
+// as bits of the old three byte format (buttons 0-3, global banks 4-7,
+// external banks 8-11, shifted global banks 12-15, shift button 16), packed
+// seven bits at a time into three payload bytes.
+//
+// PIC_CMD_BRIGHTNESS sets the brightness the PIC uses for one external LED
+// when it is lit. The payload is the LED number (or PIC_ALL_LEDS), the
+// brightness from 0 to 127 and a zero pad byte. LEDs start at full
+// brightness.
+#define PIC_CMD_LEDS        0x80
+#define PIC_CMD_BRIGHTNESS  0x81
+#define PIC_ALL_LEDS        0x7f
+#define PIC_FRAME_SIZE      5
+
+// Frames are only sent when the external LED state changes, plus a refresh
+// this often (in milliseconds) to repair a dropped frame and keep the PIC's
+// watchdog fed.
+#define PIC_REFRESH_TICKS 1000
+
 // Globals
 
 extern uint8_t global_bank;
@@ -41,8 +68,10 @@ extern uint8_t demo_mode;
 
 // Functions
 
+void mod_setup (void);
 uint16_t read_external_inputs (void/*uint8_t* midifighter_bank_up, uint8_t* midifighter_bank_down*/);
 void set_external_leds (void);
+void set_external_led_brightness (uint8_t led, uint8_t brightness);
 
 //uint8_t switch_bank (uint8_t current_bank, uint8_t new_bank, uint8_t base_note);
 
@@ -28,6 +28,7 @@
 #include "midi.h"
 #include "eeprom.h"
 #include "expansion.h"
+#include "analog.h"
 #include "constants.h"
 
 // Globals ---------------------------------------------------------------------
@@ -102,9 +103,17 @@ bool test_read_expansion(void)
     return true;
 }
 
+// Measure the noise floor of the enabled pots, which are at rest on the
+// test rig. A pot whose readings wander by an eighth of the range or more
+// has a broken wiper or isn't connected.
 bool test_read_adc(void)
 {
-    // TODO(rgreen) Add this test once we have the hardware test rig.
+    analog_measure_noise();
+    for (uint8_t i=0; i<NUM_ANALOG; ++i) {
+        if (analog_noise_floor(i)->spread >= ANALOG_BROKEN_SPREAD) {
+            return false;
+        }
+    }
     return true;
 }
 
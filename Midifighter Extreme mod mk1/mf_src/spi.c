@@ -21,7 +21,9 @@
 // rgreen 2009-05-22
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include "spi.h"
+#include "key.h"
 #include "constants.h"
 
 
@@ -65,6 +67,9 @@ void spi_setup(void)
     //    MSTR (bit4) = function as Master.
     //    SPR1 (bit1) = clock rate hi bit (=0)
     //    SPR0 (bit0) = clock rate lo bit to fck/16 (=1)
+    //
+    // This is only the bus default, each slave's own clock rate and mode
+    // are applied whenever it is selected (see spi_configure_slave()).
     SPCR = _BV(SPE) + _BV(MSTR) + _BV(SPR0);
 }
 
@@ -88,23 +93,119 @@ uint8_t spi_transmit(uint8_t byte)
 }
 
 // Slave map
+//
+// The slave table only changes while the subsystems are being set up, so
+// spi_install_slave() does most of the decoding up front. Each slave records
+// the port its chip select lives on, its bit and the level that selects
+// it, and the deselected state of every chip select is folded
+// into one set/clear mask pair per port. Selecting and deselecting a slave
+// is then a few read-modify-write port operations instead of a walk over
+// the whole table, which matters as the mod's analog scan calls adc_read()
+// around 100 times per pass.
+//
+// RAM is tight, so the map only has room for the slaves in constants.h,
+// the small fields share a byte, the port register is found from the port
+// number by a switch, the time a byte takes is worked out from the clock
+// rate and the scheduler's bus time is counted in SPI_TIME_UNIT_US units
+// to fit a byte.
+#define SPI_TIME_UNIT_US 4
+
 typedef struct {
 	uint8_t enabled : 1;
-	uint8_t ss_value : 1;
-	uint8_t port : 4;
-	uint8_t pin;
+	uint8_t ss_value : 1;       // Chip select level that selects
+	uint8_t port : 2;
+	uint8_t spi2x : 1;          // SPI2X (double speed) to select
+	uint8_t priority : 2;       // Scheduler priority, 0 is most urgent
+	uint8_t pin;                // Chip select bit in the port
+	uint8_t spcr;               // SPCR value (clock rate and mode) to select
+	volatile uint8_t pending;   // A frame is waiting to be flushed
+	uint8_t budget;             // Bus time allowed per millisecond tick
+	uint8_t used;               // Bus time used in the current tick
+	spi_flush_t flush;          // Sends the pending frame, 0 if synchronous
 } slave_t;
-#define MAX_SLAVES  8
-slave_t slave_map[MAX_SLAVES] = {{0,0},}; // 8 SPI slaves ought to be enough for everyone ;-)
+#define MAX_SLAVES  SPI_NUM_SLAVES
+slave_t slave_map[MAX_SLAVES] = {{0,0},};
 uint8_t currently_selected = 0xff;
 
+// Per-port masks that put every installed slave into its deselected state.
+static uint8_t idle_set[SPI_PORT_D + 1];
+static uint8_t idle_clr[SPI_PORT_D + 1];
+
+// The output register of a chip select port. There is no PORTA on the
+// AT90USB162, so slaves on port A are never driven. This is looked up on
+// every select rather than kept in the slave map, to save RAM.
+static volatile uint8_t* spi_port_register (uint8_t port)
+{
+	switch (port) {
+		case SPI_PORT_B: return &PORTB;
+		case SPI_PORT_C: return &PORTC;
+		case SPI_PORT_D: return &PORTD;
+		default:         return 0;
+	};
+}
+
 // Install a new SPI slave by assigning a chip select pin
 void spi_install_slave (uint8_t id, uint8_t port, uint8_t pin, uint8_t select_with)
 {
-	slave_map[id].enabled = 1;
-	slave_map[id].port = port & 0x7;
-	slave_map[id].ss_value = select_with & 0x1;
-	slave_map[id].pin = pin;
+	slave_t *slave = &slave_map[id];
+	slave->enabled = 1;
+	slave->port = port & 0x3;
+	slave->ss_value = select_with & 0x1;
+
+	slave->pin = pin;
+
+	// Until told otherwise the slave runs at the bus default of fck/16.
+	spi_configure_slave(id, 16, SPI_MODE_0);
+
+	// Rebuild the idle masks from scratch so that reinstalling a slave on a
+	// different pin doesn't leave a stale bit behind.
+	for (uint8_t p=0; p <= SPI_PORT_D; ++p) {
+		idle_set[p] = 0x0;
+		idle_clr[p] = 0x0;
+	}
+	for (uint8_t i=0; i < MAX_SLAVES; ++i) {
+		if (slave_map[i].enabled) {
+			// Deselecting is the opposite of selecting.
+			if (slave_map[i].ss_value) {
+				idle_clr[slave_map[i].port] |= slave_map[i].pin;
+			} else {
+				idle_set[slave_map[i].port] |= slave_map[i].pin;
+			}
+		}
+	}
+}
+
+// Set the SPI clock rate (fck/divider, where divider is a power of two from
+// 2 to 128) and SPI mode used to talk to the slave "id". The settings are
+// applied every time the slave is selected, so fast devices don't have to
+// run at the speed of the slowest device on the bus.
+void spi_configure_slave (uint8_t id, uint8_t divider, uint8_t mode)
+{
+	// SPR1:0 pick fck/4, /16, /64 or /128, and SPI2X doubles the first three
+	// to give fck/2, /8 and /32.
+	uint8_t spr = 0;
+	uint8_t spi2x = 0;
+	switch (divider) {
+		case 2:   spr = 0; spi2x = 1; break;
+		case 4:   spr = 0; break;
+		case 8:   spr = 1; spi2x = 1; break;
+		case 16:  spr = 1; break;
+		case 32:  spr = 2; spi2x = 1; break;
+		case 64:  spr = 2; break;
+		default:  spr = 3; break;
+	};
+	slave_map[id].spcr = _BV(SPE) | _BV(MSTR) | (mode & SPI_MODE_3) | spr;
+	slave_map[id].spi2x = spi2x;
+}
+
+// Time to clock a byte out to slave "id": eight clocks at its fck/divider,
+// plus about a microsecond of chip select and register overhead. Used for
+// the bus scheduler's accounting.
+static uint8_t spi_byte_time_us (uint8_t id)
+{
+	uint8_t spr = slave_map[id].spcr & 0x03;
+	uint8_t shift = ((spr == 3) ? 7 : 2 + 2*spr) - slave_map[id].spi2x;
+	return ((uint16_t)8 << shift) / (F_CPU / 1000000UL) + 1;
 }
 
 uint8_t spi_is_selected (uint8_t id)
@@ -115,60 +216,11 @@ uint8_t spi_is_selected (uint8_t id)
 // Deselect all installed SPI slaves by setting their chip selects high
 void spi_select_none ()
 {
-	uint8_t pin;
-	uint8_t port_a_set = 0x0;
-	uint8_t port_b_set = 0x0;
-	uint8_t port_c_set = 0x0;
-	uint8_t port_d_set = 0x0;
-	
-	uint8_t port_a_clr = 0x0;
-	uint8_t port_b_clr = 0x0;
-	uint8_t port_c_clr = 0x0;
-	uint8_t port_d_clr = 0x0;
-
-	for (uint8_t i=0; i < MAX_SLAVES; ++i) {
-		if (slave_map[i].enabled) { // Slave is enabled
-			pin = slave_map[i].pin;
-			switch (slave_map[i].port) {
-				case SPI_PORT_A:
-					if (slave_map[i].ss_value) {
-						port_a_clr |= pin;
-					} else {
-						port_a_set |= pin;
-					}
-					break;
-				case SPI_PORT_B:
-					if (slave_map[i].ss_value) {
-						port_b_clr |= pin;
-					} else {
-						port_b_set |= pin;
-					}
-					break;
-				case SPI_PORT_C:
-					if (slave_map[i].ss_value) {
-						port_c_clr |= pin;
-					} else {
-						port_c_set |= pin;
-					}
-					break;
-				case SPI_PORT_D:
-					if (slave_map[i].ss_value) {
-						port_d_clr |= pin;
-					} else {
-						port_d_set |= pin;
-					}
-					break;
-				default:
-					break;
-			};
-		}
-	}
-	
 	// Disable SPI slaves
-	//PORTA = (PORTA | port_a_set) & ~port_a_clr;
-	PORTB = (PORTB | port_b_set) & ~port_b_clr;
-	PORTC = (PORTC | port_c_set) & ~port_c_clr;
-	PORTD = (PORTD | port_d_set) & ~port_d_clr;
+	//PORTA = (PORTA | idle_set[SPI_PORT_A]) & ~idle_clr[SPI_PORT_A];
+	PORTB = (PORTB | idle_set[SPI_PORT_B]) & ~idle_clr[SPI_PORT_B];
+	PORTC = (PORTC | idle_set[SPI_PORT_C]) & ~idle_clr[SPI_PORT_C];
+	PORTD = (PORTD | idle_set[SPI_PORT_D]) & ~idle_clr[SPI_PORT_D];
 	
 	currently_selected = 0xff;
 }
@@ -181,43 +233,174 @@ void spi_select (uint8_t slave)
 	spi_select_none();
 	
 	// Select desired slave
-	// Only select slave if it is enabled in the slave map
-	if (slave_map[slave].enabled) {
-		uint8_t pin = slave_map[slave].pin;
-		switch (slave_map[slave].port) {
-			case SPI_PORT_A:
-				if (slave_map[slave].ss_value) {
-					//PORTA |= pin;
-				} else {
-					//PORTA &= ~pin;
-				}
-				break;
-			case SPI_PORT_B:
-				if (slave_map[slave].ss_value) {
-					PORTB |= pin;
-				} else {
-					PORTB &= ~pin;
-				}
-				break;
-			case SPI_PORT_C:
-				if (slave_map[slave].ss_value) {
-					PORTC |= pin;
-				} else {
-					PORTC &= ~pin;
-				}
-				break;
-			case SPI_PORT_D:
-				if (slave_map[slave].ss_value) {
-					PORTD |= pin;
-				} else {
-					PORTD &= ~pin;
-				}
-				break;
-			default:
-				break;
-		};
+	// Only select slave if it is enabled in the slave map and sits on a port
+	// we can drive. Switch the bus to the slave's clock rate and mode before
+	// the chip select goes active, so it never sees a stray clock edge.
+	volatile uint8_t *port = spi_port_register(slave_map[slave].port);
+	if (slave_map[slave].enabled && port) {
+		SPCR = slave_map[slave].spcr;
+		SPSR = slave_map[slave].spi2x ? _BV(SPI2X) : 0x0;
+		if (slave_map[slave].ss_value) {
+			*port |= slave_map[slave].pin;
+		} else {
+			*port &= ~slave_map[slave].pin;
+		}
 	}
 	currently_selected = slave;
 }
 
+// SPI bus scheduler -----------------------------------------------------------
+//
+// The TLC5924 LED driver, the ADC and the PIC co-processor all share the one
+// SPI bus. Rather than letting whichever code runs first own it, each of
+// them is installed as a client with a priority and a budget of bus time
+// per millisecond tick (the TIMER0 key scan interrupt).
+//
+// Frame clients (LEDs, PIC) only ever care about their latest state. They
+// post it with spi_post() and the scheduler sends it through their flush
+// callback as soon as the bus is free and their budget allows, highest
+// priority first. The ADC reads synchronously between spi_acquire() and
+// spi_release(). Acquiring first flushes any pending frame of higher
+// priority and releasing flushes anything posted while the bus was held,
+// so LED and PIC updates are interleaved between conversions instead of
+// waiting for a whole analog scan to finish.
+//
+// Budgets are only enforced once spi_scheduler_enable() has been called
+// just before the main loop. During boot, the menu and the self test every
+// request is granted straight away, exactly as it was before.
+
+static uint8_t client_order[MAX_SLAVES]; // client ids sorted by priority
+static uint8_t num_clients = 0;
+static volatile bool bus_busy = false;   // a client is using the bus
+static bool budgets_enabled = false;
+static uint8_t budget_tick = 0;          // tick the used counts belong to
+
+// Install the slave "id" as a bus client. Frame clients pass the function
+// that transmits their pending frame, synchronous clients pass 0 and use
+// spi_acquire() and spi_release() instead.
+void spi_install_client (uint8_t id, uint8_t priority, uint16_t budget_us, spi_flush_t flush)
+{
+	slave_map[id].priority = priority;
+	slave_map[id].budget = (budget_us + SPI_TIME_UNIT_US - 1) / SPI_TIME_UNIT_US;
+	slave_map[id].used = 0;
+	slave_map[id].pending = 0;
+	slave_map[id].flush = flush;
+
+	// Insert the client into the priority order, replacing any previous
+	// installation of the same id.
+	uint8_t n = 0;
+	for (uint8_t i=0; i < num_clients; ++i) {
+		if (client_order[i] != id) {
+			client_order[n++] = client_order[i];
+		}
+	}
+	uint8_t pos = n;
+	while (pos > 0 && slave_map[client_order[pos - 1]].priority > priority) {
+		client_order[pos] = client_order[pos - 1];
+		--pos;
+	}
+	client_order[pos] = id;
+	num_clients = n + 1;
+}
+
+// Start enforcing the per-millisecond bus time budgets.
+void spi_scheduler_enable (void)
+{
+	budget_tick = (uint8_t)g_key_ticks;
+	budgets_enabled = true;
+}
+
+// Start a fresh set of budgets whenever the millisecond tick has moved on.
+static void spi_refill_budgets (void)
+{
+	uint8_t tick = (uint8_t)g_key_ticks;
+	if (tick != budget_tick) {
+		budget_tick = tick;
+		for (uint8_t i=0; i < num_clients; ++i) {
+			slave_map[client_order[i]].used = 0;
+		}
+	}
+}
+
+static bool spi_has_budget (uint8_t id)
+{
+	return !budgets_enabled || slave_map[id].used < slave_map[id].budget;
+}
+
+// Charge the client "id" for sending "bytes" bytes. The count saturates
+// rather than wrapping, so a long transaction still uses up the budget.
+static void spi_charge (uint8_t id, uint8_t bytes)
+{
+	uint16_t used = slave_map[id].used +
+		((uint16_t)bytes * spi_byte_time_us(id) + SPI_TIME_UNIT_US - 1) /
+		SPI_TIME_UNIT_US;
+	slave_map[id].used = used > 0xff ? 0xff : used;
+}
+
+// Send the pending frames of every client more urgent than "priority" that
+// still has bus time left in this tick.
+static void spi_flush_pending (uint8_t priority)
+{
+	// If we interrupted a transaction, leave the frame pending. It is sent
+	// when the bus is released.
+	if (bus_busy) return;
+	bus_busy = true;
+
+	spi_refill_budgets();
+	for (uint8_t i=0; i < num_clients; ++i) {
+		slave_t *client = &slave_map[client_order[i]];
+		if (client->priority >= priority) break;
+		if (client->pending && client->flush && spi_has_budget(client_order[i])) {
+			// Clear the flag before sending, so a frame posted from an
+			// interrupt during the flush is sent again next time.
+			client->pending = 0;
+			spi_select(client_order[i]);
+			uint8_t bytes = client->flush();
+			spi_select_none();
+			spi_charge(client_order[i], bytes);
+		}
+	}
+
+	bus_busy = false;
+}
+
+// Mark the client's frame as pending and send it if the bus is available.
+void spi_post (uint8_t id)
+{
+	slave_map[id].pending = 1;
+	spi_flush_pending(0xff);
+}
+
+// Send any frames that were held back because their client ran out of bus
+// time. Called once per pass of the main loop.
+void spi_service (void)
+{
+	spi_flush_pending(0xff);
+}
+
+// Take the bus for a synchronous transaction with slave "id", selecting it.
+// Returns false if the client has used up its bus time for this tick, in
+// which case the caller should try again later.
+bool spi_acquire (uint8_t id)
+{
+	spi_flush_pending(slave_map[id].priority);
+	if (bus_busy) return false;
+	spi_refill_budgets();
+	if (!spi_has_budget(id)) return false;
+	bus_busy = true;
+	spi_select(id);
+	return true;
+}
+
+// End a synchronous transaction, charging the client for "bytes" bytes of
+// bus time, then send whatever was posted while the bus was held.
+void spi_release (uint8_t bytes)
+{
+	uint8_t id = currently_selected;
+	spi_select_none();
+	spi_charge(id, bytes);
+	bus_busy = false;
+	spi_flush_pending(0xff);
+}
+
 // -----------------------------------------------------------------------------
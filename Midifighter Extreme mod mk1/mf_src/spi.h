@@ -23,11 +23,15 @@
 #ifndef _SPI_H_INCLUDED
 #define _SPI_H_INCLUDED
 
+#include <stdbool.h>
+#include <stdint.h>
+
 // SPI functions ---------------------------------------------------------------
 
 void spi_setup(void);
 uint8_t spi_transmit(uint8_t byte);
 void spi_install_slave (uint8_t id, uint8_t port, uint8_t pin, uint8_t select_with);
+void spi_configure_slave (uint8_t id, uint8_t divider, uint8_t mode);
 uint8_t spi_is_selected (uint8_t id);
 void spi_select (uint8_t slave);
 void spi_select_none (void);
@@ -40,4 +44,23 @@ void spi_select_none (void);
 #define SPI_LOW_TO_SELECT 0
 #define SPI_HIGH_TO_SELECT 1
 
+// SPI modes, as the CPOL and CPHA bits of SPCR.
+#define SPI_MODE_0 0x00  // CPOL=0 CPHA=0, sample on rising edge
+#define SPI_MODE_1 0x04  // CPOL=0 CPHA=1, sample on falling edge
+#define SPI_MODE_2 0x08  // CPOL=1 CPHA=0, sample on falling edge
+#define SPI_MODE_3 0x0c  // CPOL=1 CPHA=1, sample on rising edge
+
+// SPI bus scheduler -----------------------------------------------------------
+
+// Called with the client's slave selected to send its pending frame,
+// returning the number of bytes transmitted.
+typedef uint8_t (*spi_flush_t)(void);
+
+void spi_install_client (uint8_t id, uint8_t priority, uint16_t budget_us, spi_flush_t flush);
+void spi_scheduler_enable (void);
+void spi_post (uint8_t id);
+void spi_service (void);
+bool spi_acquire (uint8_t id);
+void spi_release (uint8_t bytes);
+
 #endif // _SPI_H_INCLUDED
@@ -0,0 +1,157 @@
+// SysEx commands for the Midifighter Extreme mod.
+
+#include "sysex.h"
+#include "analog.h"
+#include "curve.h"
+#include "midi.h"
+#include "expansion.h"
+#include "eeprom.h"
+#include "mod.h"
+#ifdef COMBO
+#include "combo.h"
+#endif
+
+// Position in the message being received: 0 is the manufacturer ID, 1 the
+// command and data bytes follow. SYSEX_IGNORE while there is no message or
+// it isn't for us.
+#define SYSEX_IGNORE 0xff
+static uint8_t sysex_pos = SYSEX_IGNORE;
+static uint8_t sysex_command;
+
+// The first data byte of the message, for commands that need it later.
+static uint8_t sysex_arg;
+
+#ifdef COMBO
+// Load an uploaded combo table and say whether it was accepted. The reply
+// is streamed once the table is loaded, so no buffer for it is held on the
+// stack through combo_commit(), the deepest call in the firmware.
+static void sysex_combo_commit (uint8_t num_rules)
+{
+	bool accepted = combo_commit(num_rules);
+	midi_stream_sysex_byte(0xf0);
+	midi_stream_sysex_byte(SYSEX_ID);
+	midi_stream_sysex_byte(SYSEX_COMBO_COMMIT);
+	midi_stream_sysex_byte(accepted ? 1 : 0);
+	midi_stream_sysex_byte(0xf7);
+}
+#endif
+
+// Act on data byte "index" of the current message.
+static void sysex_data (uint8_t index, uint8_t byte)
+{
+	switch (sysex_command) {
+	case SYSEX_CURVE_POINTS:
+		if (index == 0) {
+			sysex_arg = byte;
+		} else {
+			curve_set_custom(sysex_arg++, byte);
+		}
+		break;
+	case SYSEX_CHANNEL_MAP:
+		if (index == 0) {
+			sysex_arg = byte;
+		} else {
+			analog_set_slot(sysex_arg++, byte);
+		}
+		break;
+#ifdef COMBO
+	case SYSEX_COMBO_RULES:
+		if (index == 0) {
+			sysex_arg = byte;
+		} else {
+			combo_write_byte(sysex_arg * COMBO_RULE_SIZE + index - 1, byte);
+		}
+		break;
+	case SYSEX_COMBO_COMMIT:
+		if (index == 0) {
+			sysex_combo_commit(byte);
+		}
+		break;
+#endif
+	case SYSEX_PRESET:
+		if (index == 0) {
+			sysex_arg = byte;
+		} else {
+			eeprom_preset_write(sysex_arg, index - 1, byte);
+		}
+		break;
+	case SYSEX_BRIGHTNESS:
+		if (index == 0) {
+			sysex_arg = byte;
+		} else if (sysex_arg == PIC_ALL_LEDS) {
+			if (index == 1) set_external_led_brightness(PIC_ALL_LEDS, byte);
+		} else {
+			set_external_led_brightness(sysex_arg++, byte);
+		}
+		break;
+	case SYSEX_CURVE_SELECT:
+		if (index == 0) {
+			sysex_arg = byte;
+		} else if (index == 1) {
+			analog_set_curve(sysex_arg, byte);
+		}
+		break;
+	}
+}
+
+// Send the noise floor of every pot, a byte at a time so that the whole
+// report never has to sit on the stack.
+static void sysex_noise_report (void)
+{
+	midi_stream_sysex_byte(0xf0);
+	midi_stream_sysex_byte(SYSEX_ID);
+	midi_stream_sysex_byte(SYSEX_NOISE_REPORT);
+	for (uint8_t i=0; i < NUM_ANALOG; ++i) {
+		const analog_noise_t* pot = analog_noise_floor(i);
+		midi_stream_sysex_byte(adc_value[i] >> 3);
+		midi_stream_sysex_byte(adc_value[i] & 0x07);
+		midi_stream_sysex_byte((pot->spread > 0x7f) ? 0x7f : pot->spread);
+		midi_stream_sysex_byte(pot->band);
+		midi_stream_sysex_byte(pot->smoothing);
+	}
+	midi_stream_sysex_byte(0xf7);
+}
+
+// Act on the end of the current message, for commands without data.
+static void sysex_end (void)
+{
+	switch (sysex_command) {
+	case SYSEX_NOISE_MEASURE:
+		analog_measure_noise();
+		sysex_noise_report();
+		break;
+	case SYSEX_NOISE_REPORT:
+		sysex_noise_report();
+		break;
+	}
+}
+
+// Take the next byte of an incoming SysEx stream.
+void sysex_receive (uint8_t byte)
+{
+	if (byte == 0xf0) {
+		sysex_pos = 0;
+		return;
+	}
+	if (byte & 0x80) {
+		// F7, or any other status byte, ends the message.
+		if (byte == 0xf7 && sysex_pos != SYSEX_IGNORE && sysex_pos >= 2) {
+			sysex_end();
+		}
+		sysex_pos = SYSEX_IGNORE;
+		return;
+	}
+	if (sysex_pos == SYSEX_IGNORE) return;
+
+	if (sysex_pos == 0) {
+		if (byte != SYSEX_ID) {
+			sysex_pos = SYSEX_IGNORE;
+			return;
+		}
+	} else if (sysex_pos == 1) {
+		sysex_command = byte;
+	} else {
+		sysex_data(sysex_pos - 2, byte);
+	}
+	if (sysex_pos < SYSEX_IGNORE - 1) ++sysex_pos;
+}
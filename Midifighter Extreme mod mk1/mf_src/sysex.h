@@ -0,0 +1,55 @@
+// SysEx commands for the Midifighter Extreme mod.
+//
+// Messages are F0 7D <command> <data...> F7, 7D being the manufacturer ID
+// set aside for non-commercial use. Data bytes are acted on as they arrive,
+// so a message of any length needs no buffer.
+//
+//   F0 7D 01 <x> <y> <y> ... F7   Set the custom curve from point x on
+//   F0 7D 02 <pot> <curve> F7     Select the curve a pot uses (CURVE_*)
+//   F0 7D 03 F7                   Measure the pots' noise floor again
+//   F0 7D 04 F7                   Report the pots' noise floor
+//   F0 7D 05 <slot> <kind> ... F7 Set the channel map from slot on, taking
+//                                 effect at the next boot (ANALOG_POT etc.)
+//   F0 7D 06 <rule> <b> ... F7    Upload combo rules from rule on, four
+//                                 bytes each (state, key, next, action)
+//   F0 7D 07 <count> F7           Use the first count uploaded rules, or
+//                                 the built-in combos if count is 0
+//   F0 7D 08 <preset> <b> ... F7  Store the settings of a preset: MIDI
+//                                 channel, velocity, keypress LED,
+//                                 fourbanks mode, digital and analog pins
+//   F0 7D 09 <led> <b> <b> ... F7 Set the brightness of the external LEDs
+//                                 from led on, 0 to 127. Led 7F sets every
+//                                 one to the first brightness.
+//
+// The combo table is validated when it is used, and the result sent back
+// as F0 7D 07 <ok> F7. A table that fails leaves the built-in combos on.
+//
+// Presets are switched to by a MIDI program change on the current channel,
+// program 0 being the first, or by the preset combo.
+//
+// The noise floor is reported as F0 7D 04 followed by five bytes for each
+// pot, its value (high seven bits, then low three), the peak-to-peak noise,
+// the dead band and the smoothing, then F7. Measuring again also sends the
+// report, when each value is still the mean reading just measured.
+
+#ifndef _SYSEX_H_INCLUDED
+#define _SYSEX_H_INCLUDED
+
+#include <stdint.h>
+
+#define SYSEX_ID            0x7d
+#define SYSEX_CURVE_POINTS  0x01
+#define SYSEX_CURVE_SELECT  0x02
+#define SYSEX_NOISE_MEASURE 0x03
+#define SYSEX_NOISE_REPORT  0x04
+#define SYSEX_CHANNEL_MAP   0x05
+#define SYSEX_COMBO_RULES   0x06
+#define SYSEX_COMBO_COMMIT  0x07
+#define SYSEX_PRESET        0x08
+#define SYSEX_BRIGHTNESS    0x09
+
+// Functions
+
+void sysex_receive (uint8_t byte);
+
+#endif
@@ -21,26 +21,77 @@
 ;   B2          SS
 ;   B3          MISO
 ;
-; LED states sent over SPI in this order:
-;         MSB       LSB
-; Byte 1:   GGGG BBBB   G = Global Bank buttons, B = Buttons
-; Byte 2:   SSSS EEEE   S = Shifted Global Bank buttons, E = External four banks mode buttons
-; Byte 3:   ---- ---X   X = Shift button
+; LED states are sent over SPI in frames:
+;
+;   1LLL LLLL   Command byte, the only bytes with the top bit set
+;   0ppp pppp   Payload bytes, 7 bits each
+;   0ccc cccc   Checksum, XOR of the command and payload bytes
+;
+; Any command byte starts a new frame, so a lost or corrupted byte only
+; costs the frame it was in. Frames with a bad checksum are dropped.
+;
+; Command 0x80 (LEDs) has three payload bytes carrying 17 LED bits, seven
+; at a time starting from the lowest:
+;
+;   Bits  0 - 3     Buttons
+;   Bits  4 - 7     Global Bank buttons
+;   Bits  8 - 11    External four banks mode buttons
+;   Bits 12 - 15    Shifted Global Bank buttons
+;   Bit  16         Shift button
+;
+; Command 0x81 (Brightness) sets how bright an LED is when it is lit. The
+; payload is the LED number (0x7f for all of them), the brightness from 0
+; to 127 and a zero byte. Every LED starts at full brightness.
+;
+; Brightness is done with bit angle modulation. Whenever the LED state or a
+; brightness changes the idle loop builds seven bit planes, each holding the
+; LATA and LATB values of the LEDs that have that bit of their brightness
+; set. Timer 1 shows plane n for LSB_TICKS << n cycles, so a full cycle is
+; 127 * LSB_TICKS cycles (about 4.4ms) and costs seven short interrupts.
+; New planes are built into the buffer the timer isn't showing and swapped
+; in at the start of a cycle, so a change never shows half drawn. The CPU
+; idles between interrupts.
 
 
 .include "p24HJ32GP302.inc"
+
+        .section .nbss, bss, near
+led_state:      .space 2        ; LEDs 0 - 15, as last sent by the AVR
+led_state_hi:   .space 2        ; LED 16 in bit 0
+plane_ptr:      .space 2        ; Bit planes the timer is showing
+plane_next:     .space 2        ; Bit planes to show from the next cycle
+plane_num:      .space 2        ; Plane the timer will show next
+update:         .space 2        ; Set when the bit planes need rebuilding
+planes_a:       .space 28       ; Two sets of bit planes, a LATA and a LATB
+planes_b:       .space 28       ; word for each plane
+brightness:     .space 17       ; Brightness of each LED, 0 - 127
+
 .text
 .global __reset
 .global __SPI1Interrupt
+.global __T1Interrupt
+
+.equ CMD_LEDS, 0x80
+.equ CMD_BRIGHTNESS, 0x81
+.equ ALL_LEDS, 0x7f
+.equ NUM_LEDS, 17
 
-.equ LED_STATE_A, W10
-.equ LED_STATE_B, W11
-.equ SPI_NUM, W12
-.equ LED_READY, W13
+.equ NUM_PLANES, 7
+.equ PLANE_BYTES, 28    ; NUM_PLANES * 4
+.equ LSB_TICKS, 128     ; Cycles the lowest bit plane is shown for
+
+.equ FRAME_CMD, W6      ; Command byte of the frame being received
+.equ FRAME_SUM, W7      ; Running checksum
+.equ FRAME_P0, W8       ; Payload bytes
+.equ FRAME_P1, W9
+.equ FRAME_P2, W10
+.equ FRAME_POS, W12     ; Next byte in the frame, 0 = waiting for a command
 
 __reset:
-	; Set stack limit
-	mov 	#0x0a00, W0
+	; Set stack pointer and limit. The stack used to start at the bottom
+	; of RAM, which is where the linker puts our variables.
+	mov 	#__SP_init, W15
+	mov 	#__SPLIM_init, W0
         mov 	W0, SPLIM
 
         ; Set analog inputs as digital
@@ -95,23 +146,149 @@ __reset:
         call 	self_test
 
         ; Set up registers
-        mov	#0x0, SPI_NUM
-
-        ; Keep W0 as zero register
-        mov	#0x0, W0
+        mov	#0x0, FRAME_POS
+
+        ; Start with every LED off at full brightness and both sets of bit
+        ; planes dark
+        clr	led_state
+        clr	led_state_hi
+        mov	#brightness, W1
+        mov	#0x7f, W2
+        repeat	#NUM_LEDS-1
+        mov.b	W2, [W1++]
+        mov	#planes_a, W1
+        repeat	#PLANE_BYTES-1 ; Both buffers, a word at a time
+        clr	[W1++]
+        mov	#planes_a, W1
+        mov	W1, plane_ptr
+        mov	W1, plane_next
+        clr	plane_num
+        clr	update
+
+        ; Configure Timer 1 to step through the bit planes, clocked from Fcy
+        ; with no prescaler
+        clr	T1CON
+        clr	TMR1
+        mov	#LSB_TICKS-1, W1
+        mov	W1, PR1
+
+        ; SPI (IPC2<10:8>) goes up to priority 5 and Timer 1 (IPC0<14:12>)
+        ; down to 3, so a received byte is never held up by a plane change
+        bset	IPC2, #0x8
+        bclr	IPC0, #0xe
+        bset	IPC0, #0xd
+        bset	IPC0, #0xc
 
         ; Enable interrupts
         bclr	IFS0, #0xa     ; Clear Interrupt Flag IFS0<10>
         bset	IEC0, #0xa     ; Enable Interrupt IEC0<10>
+        bclr	IFS0, #0x3     ; Clear Timer 1 Interrupt Flag IFS0<3>
+        bset	IEC0, #0x3     ; Enable Timer 1 Interrupt IEC0<3>
+        bset	T1CON, #0xf    ; Start Timer 1
 
-        ; Loop forever doing nothing, logic handled in SPI data transfer interrupt
+        ; Idle until an interrupt wakes us, and rebuild the bit planes if
+        ; the SPI interrupt changed anything. The timer keeps running in
+        ; idle mode, unlike sleep.
 idle_loop:
-        nop
-        ;pwrsav	#IDLE_MODE
+        pwrsav	#IDLE_MODE
+        cp0	update
+        bra	Z, idle_loop
+        call	build_planes
         bra	idle_loop
 
 
 
+; Build the bit planes for the current LED state and brightness into the
+; buffer the timer isn't showing, and hand it over. Uses W0 - W5, W11, W13
+; and W14, which the interrupts leave alone.
+build_planes:
+        ; Wait for the timer to pick up the planes we built last time
+        mov	plane_ptr, W0
+        mov	plane_next, W1
+        cp	W0, W1
+        bra	Z, build_start
+        pwrsav	#IDLE_MODE
+        bra	build_planes
+build_start:
+        ; Build into whichever buffer the timer isn't showing
+        mov	#planes_a, W14
+        cp	W0, W14
+        bra	NZ, build_clear
+        mov	#planes_b, W14
+build_clear:
+        ; Clear the request before reading the state, so a frame that
+        ; arrives while we're building gets another pass
+        clr	update
+
+        mov	#0x1, W11      ; Brightness bit of this plane
+plane_loop:
+        ; W2 gets LEDs 0 - 15 and W3 LED 16 with this brightness bit set
+        clr	W2
+        mov	#brightness, W1
+        mov	#0x1, W13      ; LED bit in W2
+led_loop:
+        ze	[W1++], W0
+        and	W0, W11, W0
+        bra	Z, led_next
+        ior	W2, W13, W2
+led_next:
+        sl	W13, #0x1, W13
+        bra	NZ, led_loop
+        clr	W3
+        ze	[W1], W0
+        and	W0, W11, W0
+        btss	SR, #0x1       ; Z
+        bset	W3, #0x0
+
+        ; Keep only the LEDs that are lit
+        mov	led_state, W0
+        and	W2, W0, W2
+        mov	led_state_hi, W0
+        and	W3, W0, W3
+
+        call	map_leds
+        mov	W4, [W14++]
+        mov	W5, [W14++]
+
+        sl	W11, #0x1, W11
+        btss	W11, #NUM_PLANES
+        bra	plane_loop
+
+        ; Show the new planes from the next cycle
+        sub	#PLANE_BYTES, W14
+        mov	W14, plane_next
+        return
+
+
+
+; Map LEDs 0 - 15 in W2 and LED 16 in bit 0 of W3 to their pins. Returns
+; the LATA value in W4 and the LATB value in W5, uses W0.
+map_leds:
+        ; Port A: buttons on A0 - A3, bank 2 on A4
+        and	W2, #0xf, W4
+        btsc	W2, #0x9
+        bset	W4, #0x4
+
+        ; Port B: global banks on B12 - B15, shifted global banks on
+        ; B7 - B10, banks 1, 3 and 4 on B4 - B6 and shift on B11
+        mov	#0xf0, W5
+        and	W2, W5, W5
+        sl	W5, #0x8, W5
+        lsr	W2, #0xc, W0
+        sl	W0, #0x7, W0
+        ior	W5, W0, W5
+        btsc	W2, #0x8
+        bset	W5, #0x4
+        btsc	W2, #0xa
+        bset	W5, #0x5
+        btsc	W2, #0xb
+        bset	W5, #0x6
+        btsc	W3, #0x0
+        bset	W5, #0xb
+        return
+
+
+
 ; self test routine
 self_test:
         ; Turn all LEDs off
@@ -153,70 +330,147 @@ dloop:	dec 	W4, W4
 
 ; SPI1 Transfer Done Interrupt 
 __SPI1Interrupt:
+        ; Nothing outranks this interrupt, so it can have the shadow
+        ; registers for W0 - W3
+        push.s
         mov	SPI1BUF, W1 ; Read SPI1 data
         ; Zero the SPI buffer
         mov	#0x0, W0
         mov	W0, SPI1BUF
-
-        ; Test which byte is being received
-        cp0	SPI_NUM
-        bra 	NZ, second_set ; second or third
-
-        ; Second byte next time
-        inc	SPI_NUM, SPI_NUM
-
-        ; Output first byte to correct LED pins
-        and	W1, #0xf, W0
-        mov	W0, PORTA
-        mov	#0xf0, W2
-        and	W1, W2, W1
-        sl	W1, #0x8, W1
-        mov	W1, PORTB
+        ; If we missed a byte, clear the overflow so reception carries on.
+        ; The frame it belonged to will fail its checksum.
+        bclr	SPI1STAT, #0x6
+
+        ; A command byte always starts a new frame, whatever state we were
+        ; in. This is how we resynchronise after a lost byte.
+        btst	W1, #0x7
+        bra	Z, payload_byte
+        mov	W1, FRAME_CMD
+        mov	W1, FRAME_SUM
+        mov	#0x1, FRAME_POS
         goto	done
 
-second_set:
-        ; Check if the second or third byte is being received
-        dec	SPI_NUM, W2
-        cp0	W2
-        bra	NZ, third_set ; Its the third byte
-
-        ; Output byte to correct LEDs
-        ; Code below is retarded because it was late at night and I wanted to get it working asap
-        ; turns out the bug was on the midifighter side - I was sending the data wrong!
-        ; TODO: rewrite this code in a nicer way
-        bclr	PORTA, #0x4
-        btsc	W1, #0x1
-        bset	PORTA, #0x4
-
-        bclr	W1, #0x1
-        sl	W1, #0x3, W3
-        mov	PORTB, W2
-        ior	W3, W2, W2
-        mov	W2, PORTB
-
-        btsc	W1, #0x0
-        bset	LATB, #0x4
-        btsc	W1, #0x2
-        bset	LATB, #0x5
-        btsc	W1, #0x3
-        bset	LATB, #0x6
-
-        ; Advance to next byte
-        inc	SPI_NUM, SPI_NUM
+payload_byte:
+        ; Ignore payload bytes until we see a command byte
+        cp0	FRAME_POS
+        bra	Z, done
+        cp	FRAME_POS, #0x4
+        bra	Z, checksum_byte
+
+        ; Store the payload byte and add it to the checksum
+        xor	FRAME_SUM, W1, FRAME_SUM
+        cp	FRAME_POS, #0x1
+        bra	NZ, payload_1
+        mov	W1, FRAME_P0
+        bra	next_byte
+payload_1:
+        cp	FRAME_POS, #0x2
+        bra	NZ, payload_2
+        mov	W1, FRAME_P1
+        bra	next_byte
+payload_2:
+        mov	W1, FRAME_P2
+next_byte:
+        inc	FRAME_POS, FRAME_POS
         goto	done
 
-third_set:
-        ; Output third byte to correct LEDs
-        btsc	W1, #0x0
-        bset	LATB, #0xb
+checksum_byte:
+        ; The frame is over either way, wait for the next command byte
+        mov	#0x0, FRAME_POS
+        ; Drop the frame if the checksum doesn't match
+        and	#0x7f, FRAME_SUM
+        cp	FRAME_SUM, W1
+        bra	NZ, done
+        ; Drop frames we don't understand
+        mov	#CMD_LEDS, W2
+        cp	FRAME_CMD, W2
+        bra	Z, leds_frame
+        mov	#CMD_BRIGHTNESS, W2
+        cp	FRAME_CMD, W2
+        bra	Z, brightness_frame
+        bra	done
+
+leds_frame:
+        ; Reassemble LED bits 0 - 15, bit 16 is bit 2 of FRAME_P2
+        sl	FRAME_P1, #0x7, W2
+        ior	W2, FRAME_P0, W2
+        sl	FRAME_P2, #0xe, W3
+        ior	W2, W3, W2
+        mov	W2, led_state
+        lsr	FRAME_P2, #0x2, W3
+        and	W3, #0x1, W3
+        mov	W3, led_state_hi
 
-        ; Reset the byte counter
-        mov	#0x0, SPI_NUM
         ; Clear watchdog timer
         clrwdt
+        bra	request_update
+
+brightness_frame:
+        ; FRAME_P0 is the LED and FRAME_P1 its brightness
+        mov	#brightness, W1
+        mov	#ALL_LEDS, W2
+        cp	FRAME_P0, W2
+        bra	Z, brightness_all
+        mov	#NUM_LEDS, W2
+        cp	FRAME_P0, W2
+        bra	GEU, done
+        add	W1, FRAME_P0, W1
+        mov.b	FRAME_P1, [W1]
+        bra	request_update
+brightness_all:
+        repeat	#NUM_LEDS-1
+        mov.b	FRAME_P1, [W1++]
+
+request_update:
+        ; Have the idle loop rebuild the bit planes
+        mov	#0x1, W2
+        mov	W2, update
 
 done:
         bclr	IFS0, #0xa       ; Clear Interrupt Flag IFS0<10>
+        pop.s
+        retfie
+
+
+
+; Timer 1 Interrupt, shows the next bit plane
+__T1Interrupt:
+        ; The SPI interrupt can break in and uses the shadow registers, so
+        ; save ours on the stack
+        push.d	W0
+        push	W2
+
+        ; Show the plane
+        mov	plane_ptr, W0
+        mov	plane_num, W1
+        sl	W1, #0x2, W2
+        add	W0, W2, W0
+        mov	[W0++], W2
+        mov	W2, LATA
+        mov	[W0], W2
+        mov	W2, LATB
+
+        ; Plane n is shown for LSB_TICKS << n cycles. The timer restarted
+        ; from zero when it matched, so the new period covers this plane.
+        mov	#LSB_TICKS, W2
+        sl	W2, W1, W2
+        dec	W2, W2
+        mov	W2, PR1
+
+        ; Move on to the next plane, and at the end of a cycle pick up any
+        ; planes the idle loop has built
+        inc	W1, W1
+        cp	W1, #NUM_PLANES
+        bra	NZ, t1_done
+        clr	W1
+        mov	plane_next, W2
+        mov	W2, plane_ptr
+t1_done:
+        mov	W1, plane_num
+
+        bclr	IFS0, #0x3       ; Clear Timer 1 Interrupt Flag IFS0<3>
+        pop	W2
+        pop.d	W0
         retfie
 
 .end
@@ -0,0 +1,509 @@
+// Host-side compiler for Midifighter combo tables.
+//
+// Reads a combo description and writes the rules for the combo recognizer
+// in combo.c, either as rows for state_table[] or as the SysEx messages
+// that upload them to the EEPROM. Before writing anything it checks that
+// every combo in the description can fire, and fails if one can't.
+//
+// The checks run the recognizer itself: combo.c is built into the tool,
+// the rules are loaded into it as an uploaded table would be, and every
+// combo is played to it as key events. Each sequence must fire on its last
+// step at the step timeout and not when any step comes later than that.
+// Each chord must fire in every order within the chord time and not when
+// it's spread wider. Nothing else may fire on the way, and the combos that
+// send notes must send the release when their last key goes up.
+//
+// Build and run on the host (see the Makefile):
+//
+//     make combotool
+//     ./combotool -c < builtin.combos     C rows for state_table[]
+//     ./combotool -x < my.combos          SysEx upload, as hex bytes
+//     ./combotool -t < builtin.combos     check the firmware's own table
+//
+// -t plays the combos to the built-in state_table[] in combo.c instead of
+// to rules built from the description, to check the two agree.
+//
+// A description has one combo per line, "#" starting a comment:
+//
+//     sequence <combo> <step> <step> ...
+//     chord    <combo> <key> <key> ...
+//
+// <combo> is a letter A to E, which send a note, P, which switches to the
+// next settings preset, or M, which opens the settings menu. Keys are numbered 0 to 15, left to right and
+// top to bottom. A sequence step is a key followed by "d" for a keydown,
+// "u" for a keyup or "h" for a test that the key is held. A sequence fires
+// on its last step and each step must come within COMBO_STEP_MS of the
+// one before. A chord fires when exactly its keys are held, all pressed
+// within COMBO_CHORD_MS, in any order.
+//
+// Each sequence becomes a chain of states N, N+1, ... entered from state
+// 0, which is the form the recognizer compiles into its state sets, so the
+// rules need no offsets and no cross-links between combos.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mf_src/combo.c"
+
+// The rules are loaded as the bytes of a combo_state_t, one byte per
+// field, as the firmware is built with one byte enums.
+typedef char combo_rule_size_check
+    [(sizeof(combo_state_t) == COMBO_RULE_SIZE) ? 1 : -1];
+
+#define MAX_COMBOS 16
+#define MAX_STEPS  (COMBO_MAX_STATES - 1)
+
+typedef struct {
+    int chord;                // chord (1) or sequence (0)
+    int action;               // COMBO_x_DOWN
+    int num_steps;
+    uint8_t steps[MAX_STEPS]; // key index + which keystate to test
+    int line;
+} combo_t;
+
+static combo_t combos[MAX_COMBOS];
+static int num_combos = 0;
+
+static void fail(int line, const char* message)
+{
+    if (line) {
+        fprintf(stderr, "combotool: line %d: %s\n", line, message);
+    } else {
+        fprintf(stderr, "combotool: %s\n", message);
+    }
+    exit(1);
+}
+
+// Parse one step or chord key, returning the rule's key byte.
+static uint8_t parse_key(const char* word, int chord, int line)
+{
+    char* end;
+    long key = strtol(word, &end, 10);
+    if (end == word || key < 0 || key > 15) {
+        fail(line, "keys are numbered 0 to 15");
+    }
+    if (chord) {
+        if (*end) fail(line, "chord keys take no d, u or h");
+        return KEYCHORD | key;
+    }
+    if (!strcmp(end, "d")) return KEYDOWN | key;
+    if (!strcmp(end, "u")) return KEYUP | key;
+    if (!strcmp(end, "h")) return key;
+    fail(line, "sequence steps end in d, u or h");
+    return 0;
+}
+
+static void parse(FILE* in)
+{
+    char text[512];
+    int line = 0;
+    while (fgets(text, sizeof(text), in)) {
+        ++line;
+        char* hash = strchr(text, '#');
+        if (hash) *hash = 0;
+
+        char* word = strtok(text, " \t\r\n");
+        if (!word) continue;
+        if (num_combos == MAX_COMBOS) fail(line, "too many combos");
+        combo_t* combo = &combos[num_combos++];
+        combo->line = line;
+        if (!strcmp(word, "sequence")) {
+            combo->chord = 0;
+        } else if (!strcmp(word, "chord")) {
+            combo->chord = 1;
+        } else {
+            fail(line, "expected \"sequence\" or \"chord\"");
+        }
+
+        word = strtok(NULL, " \t\r\n");
+        if (!word || strlen(word) != 1) {
+            fail(line, "combos are named A to E, P or M");
+        }
+        if (toupper(word[0]) == 'P') {
+            combo->action = COMBO_PRESET_NEXT;
+        } else if (toupper(word[0]) == 'M') {
+            combo->action = COMBO_MENU;
+        } else if (toupper(word[0]) >= 'A' && toupper(word[0]) <= 'E') {
+            combo->action = COMBO_A_DOWN + (toupper(word[0]) - 'A');
+        } else {
+            fail(line, "combos are named A to E, P or M");
+        }
+
+        combo->num_steps = 0;
+        while ((word = strtok(NULL, " \t\r\n"))) {
+            if (combo->num_steps == MAX_STEPS) fail(line, "too many steps");
+            combo->steps[combo->num_steps++] = parse_key(word, combo->chord, line);
+        }
+        if (combo->num_steps == 0) fail(line, "a combo needs at least one key");
+    }
+}
+
+// Prove that every combo can fire. The recognizer fires the first combo to
+// complete and then waits for its last key to be released, dropping every
+// other partial match, so no sequence may be the start of another. Each
+// action may only be used once, and chords need distinct keys.
+static void verify(void)
+{
+    int num_states = 1;
+    int num_rules = 0;
+    int num_chords = 0;
+    for (int i = 0; i < num_combos; ++i) {
+        combo_t* a = &combos[i];
+        if (a->chord) {
+            ++num_chords;
+            num_rules += a->num_steps;
+            uint16_t keys = 0;
+            for (int k = 0; k < a->num_steps; ++k) {
+                uint16_t bit = 1 << (a->steps[k] & 0x0f);
+                if (keys & bit) fail(a->line, "a chord key is repeated");
+                keys |= bit;
+            }
+        } else {
+            num_states += a->num_steps;
+            num_rules += a->num_steps;
+        }
+
+        for (int j = 0; j < i; ++j) {
+            combo_t* b = &combos[j];
+            if (a->action == b->action) {
+                fail(a->line, "this combo's name is already used");
+            }
+            if (a->chord || b->chord) continue;
+            int n = (a->num_steps < b->num_steps) ? a->num_steps : b->num_steps;
+            if (!memcmp(a->steps, b->steps, n)) {
+                fail(a->line, "one sequence starts with the whole of another, "
+                              "so the longer one can never fire");
+            }
+        }
+    }
+    if (num_states > COMBO_MAX_STATES) fail(0, "the sequences need too many states");
+    if (num_rules > COMBO_MAX_RULES) fail(0, "the combos need too many rules");
+    if (num_chords > COMBO_MAX_CHORDS) fail(0, "too many chords");
+}
+
+// Build the rules, sorted by state as the recognizer requires: every rule
+// leaving state 0 first, then each sequence's chain in order.
+static int build(uint8_t rules[][COMBO_RULE_SIZE])
+{
+    int n = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        int state = 1;
+        for (int i = 0; i < num_combos; ++i) {
+            combo_t* combo = &combos[i];
+            if (combo->chord) {
+                if (pass == 1) continue;
+                for (int k = 0; k < combo->num_steps; ++k) {
+                    uint8_t* rule = rules[n++];
+                    rule[0] = 0;
+                    rule[1] = combo->steps[k];
+                    rule[2] = 0;
+                    rule[3] = combo->action;
+                }
+                continue;
+            }
+            for (int k = (pass == 0) ? 0 : 1; k < ((pass == 0) ? 1 : combo->num_steps); ++k) {
+                uint8_t* rule = rules[n++];
+                rule[0] = (k == 0) ? 0 : state + k - 1;
+                rule[1] = combo->steps[k];
+                rule[2] = state + k;
+                rule[3] = (k == combo->num_steps - 1) ? combo->action : COMBO_NONE;
+            }
+            state += combo->num_steps;
+        }
+    }
+    return n;
+}
+
+static const char* action_name(int action)
+{
+    if (action == COMBO_PRESET_NEXT) return "COMBO_PRESET_NEXT";
+    if (action == COMBO_MENU) return "COMBO_MENU";
+    static const char* names[] = {
+        "COMBO_NONE", "COMBO_A_DOWN", "COMBO_B_DOWN", "COMBO_C_DOWN",
+        "COMBO_D_DOWN", "COMBO_E_DOWN",
+    };
+    return names[action];
+}
+
+static void write_c(uint8_t rules[][COMBO_RULE_SIZE], int n)
+{
+    static const char* tests[] = { "", " | KEYDOWN", " | KEYUP", " | KEYCHORD" };
+    printf("//          state  key            next action\n");
+    for (int i = 0; i < n; ++i) {
+        uint8_t* rule = rules[i];
+        char key[32];
+        snprintf(key, sizeof(key), "%2d%s,", rule[1] & 0x0f, tests[(rule[1] & KEYMASK) >> 4]);
+        printf("/* %2d */   { %2d,   %-14s %2d,  %s },\n",
+               i, rule[0], key, rule[2], action_name(rule[3]));
+    }
+}
+
+static void write_sysex(uint8_t rules[][COMBO_RULE_SIZE], int n)
+{
+    // The rules, from rule 0 on, then the commit with the rule count.
+    printf("F0 7D 06 00");
+    for (int i = 0; i < n; ++i) {
+        for (int b = 0; b < COMBO_RULE_SIZE; ++b) {
+            printf(" %02X", rules[i][b]);
+        }
+    }
+    printf(" F7\n");
+    printf("F0 7D 07 %02X F7\n", n);
+}
+
+// Replay ---------------------------------------------------------------------
+
+// What combo.c needs from the rest of the firmware: the EEPROM an uploaded
+// table is read from, the key edge and hold times and the LEDs, which are only
+// touched if the built-in table fails to compile.
+static uint8_t eeprom[512];
+uint16_t g_key_edge_tick;
+uint16_t g_key_hold_tick;
+
+uint8_t eeprom_read(uint16_t address)
+{
+    return eeprom[address & 0x1ff];
+}
+
+void eeprom_read_bytes(void* data, uint16_t address, uint8_t length)
+{
+    memcpy(data, &eeprom[address & 0x1ff], length);
+}
+
+void eeprom_write(uint16_t address, uint8_t data)
+{
+    eeprom[address & 0x1ff] = data;
+}
+
+void led_set_state(uint16_t new_state)
+{
+    (void)new_state;
+    fail(0, "the built-in table doesn't compile, combo_load() stopped");
+}
+
+static uint16_t now = 0;         // the time, in key ticks
+static uint16_t keystate = 0;    // keys held down
+
+// A key goes down or up now, timestamped the way key_calc() does it.
+// Returns the recognizer's action.
+static combo_action_t key_event(uint8_t key, int down)
+{
+    uint16_t bit = 1 << key;
+    if ((uint16_t)(now - g_key_hold_tick) > KEY_HOLD_AGE_MAX) {
+        g_key_hold_tick = now - KEY_HOLD_AGE_MAX - 1;
+    }
+    g_key_edge_tick = now;
+    if (down) {
+        if (!keystate) g_key_hold_tick = now;
+        keystate |= bit;
+        return combo_recognize(bit, 0, keystate);
+    }
+    keystate &= ~bit;
+    if (keystate) g_key_hold_tick = now - KEY_HOLD_AGE_MAX - 1;
+    return combo_recognize(0, bit, keystate);
+}
+
+// Let go of every key and wait long enough for the recognizer to forget
+// everything. Returns how many times "release" was fired on the way.
+static int reset_keys(combo_action_t release)
+{
+    int released = 0;
+    for (uint8_t key=0; key < 16; ++key) {
+        if (keystate & (1 << key)) {
+            ++now;
+            combo_action_t action = key_event(key, 0);
+            if (action != COMBO_NONE && action == release) ++released;
+        }
+    }
+    now += 4 * COMBO_STEP_MS;
+    combo_setup();
+    return released;
+}
+
+// The action a combo's release sends, or COMBO_NONE for one that just
+// fires.
+static combo_action_t release_of(int action)
+{
+    if (action >= COMBO_A_DOWN && action <= COMBO_E_DOWN) {
+        return action + (COMBO_A_RELEASE - COMBO_A_DOWN);
+    }
+    return COMBO_NONE;
+}
+
+// Check a combo fired, and sent its release as the keys went up.
+static void check_fired(const combo_t* combo, combo_action_t action, const char* how)
+{
+    char message[128];
+    if (action != combo->action) {
+        snprintf(message, sizeof(message), "this combo doesn't fire %s", how);
+        fail(combo->line, message);
+    }
+    combo_action_t release = release_of(combo->action);
+    if (reset_keys(release) != (release != COMBO_NONE)) {
+        snprintf(message, sizeof(message), "this combo doesn't send its release %s", how);
+        fail(combo->line, message);
+    }
+}
+
+// Play a sequence with "gap" ticks before each step, or "late" before step
+// "late_step". Returns the action on the last step. Until then nothing may
+// fire, unless a step is late, when other combos may start from it.
+static combo_action_t play_sequence(const combo_t* combo, uint16_t gap,
+                                    int late_step, uint16_t late)
+{
+    combo_action_t action = COMBO_NONE;
+    for (int k = 0; k < combo->num_steps; ++k) {
+        uint8_t step = combo->steps[k];
+        uint8_t key = step & 0x0f;
+        uint16_t bit = 1 << key;
+        now += (k == late_step) ? late : gap;
+        switch (step & KEYMASK) {
+        case KEYDOWN:
+            if (keystate & bit) fail(combo->line, "a step presses a key that is already down");
+            action = key_event(key, 1);
+            break;
+        case KEYUP:
+            if (!(keystate & bit)) fail(combo->line, "a step lets go of a key that isn't down");
+            action = key_event(key, 0);
+            break;
+        default:
+            // A held test passes on any key event while the key is down,
+            // so give the recognizer one for the key itself.
+            if (!(keystate & bit)) fail(combo->line, "a held step's key isn't down");
+            g_key_edge_tick = now;
+            action = combo_recognize(bit, 0, keystate);
+            break;
+        }
+        if (k < combo->num_steps - 1 && action != COMBO_NONE && late_step < 0) {
+            fail(combo->line, "another combo fires partway through this one");
+        }
+    }
+    return action;
+}
+
+// Play a chord's keys in the order "order" over "spread" ticks. Returns the
+// action on the last key. Nothing may fire before that.
+static combo_action_t play_chord(const combo_t* combo, const uint8_t* order, uint16_t spread)
+{
+    combo_action_t action = COMBO_NONE;
+    int n = combo->num_steps;
+    uint16_t start = now + COMBO_STEP_MS;
+    for (int k = 0; k < n; ++k) {
+        now = start + (n > 1 ? (uint32_t)spread * k / (n - 1) : 0);
+        action = key_event(order[k] & 0x0f, 1);
+        if (k < n - 1 && action != COMBO_NONE) {
+            fail(combo->line, "another combo fires before this chord is complete");
+        }
+    }
+    return action;
+}
+
+static void replay_sequence(const combo_t* combo)
+{
+    check_fired(combo, play_sequence(combo, COMBO_STEP_MS, -1, 0),
+                "with each step at the step timeout");
+    for (int late = 1; late < combo->num_steps; ++late) {
+        combo_action_t action = play_sequence(combo, COMBO_STEP_MS / 2, late,
+                                              COMBO_STEP_MS + 1);
+        reset_keys(COMBO_NONE);
+        if (action == combo->action) {
+            fail(combo->line, "this combo fires with a step after the timeout");
+        }
+    }
+}
+
+// Play a chord in every order, or for a big chord every rotation of its
+// keys both ways round.
+static void replay_chord(const combo_t* combo)
+{
+    int n = combo->num_steps;
+    uint8_t order[16];
+    memcpy(order, combo->steps, n);
+
+    if (n <= 6) {
+        // Heap's algorithm, playing each permutation as it's made.
+        int c[16] = {0};
+        check_fired(combo, play_chord(combo, order, COMBO_CHORD_MS), "in the chord time");
+        for (int i = 1; i < n; ) {
+            if (c[i] < i) {
+                int j = (i & 1) ? c[i] : 0;
+                uint8_t t = order[j]; order[j] = order[i]; order[i] = t;
+                check_fired(combo, play_chord(combo, order, COMBO_CHORD_MS), "in the chord time");
+                ++c[i];
+                i = 1;
+            } else {
+                c[i++] = 0;
+            }
+        }
+    } else {
+        for (int r = 0; r < 2 * n; ++r) {
+            for (int k = 0; k < n; ++k) {
+                int from = (r < n) ? (k + r) % n : (n - 1 - k + r) % n;
+                order[k] = combo->steps[from];
+            }
+            check_fired(combo, play_chord(combo, order, COMBO_CHORD_MS), "in the chord time");
+        }
+    }
+
+    if (n > 1) {
+        combo_action_t action = play_chord(combo, combo->steps, COMBO_CHORD_MS + 1);
+        reset_keys(COMBO_NONE);
+        if (action == combo->action) {
+            fail(combo->line, "this chord fires when spread wider than the chord time");
+        }
+    }
+}
+
+// Load the rules into the recognizer, as an uploaded table or, if "rules"
+// is null, the built-in table, and play every combo to it.
+static void replay(uint8_t rules[][COMBO_RULE_SIZE], int n)
+{
+    memset(eeprom, 0xff, sizeof(eeprom));
+    if (rules) {
+        memcpy(&eeprom[EE_COMBO_RULES], rules, n * COMBO_RULE_SIZE);
+        eeprom[EE_COMBO_COUNT] = n;
+        if (!combo_load()) fail(0, "the firmware rejects the table");
+    } else {
+        eeprom[EE_COMBO_COUNT] = 0;
+        combo_load();
+    }
+
+    for (int i = 0; i < num_combos; ++i) {
+        reset_keys(COMBO_NONE);
+        if (combos[i].chord) {
+            replay_chord(&combos[i]);
+        } else {
+            replay_sequence(&combos[i]);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2 || (strcmp(argv[1], "-c") && strcmp(argv[1], "-x") &&
+                      strcmp(argv[1], "-t"))) {
+        fprintf(stderr, "usage: combotool -c | -x | -t < combos\n");
+        return 2;
+    }
+
+    parse(stdin);
+    if (num_combos == 0) fail(0, "no combos");
+    verify();
+
+    if (argv[1][1] == 't') {
+        replay(NULL, 0);
+        return 0;
+    }
+
+    uint8_t rules[COMBO_MAX_RULES][COMBO_RULE_SIZE];
+    int n = build(rules);
+    replay(rules, n);
+    if (argv[1][1] == 'c') {
+        write_c(rules, n);
+    } else {
+        write_sysex(rules, n);
+    }
+    return 0;
+}
@@ -0,0 +1,418 @@
+// Host-side test of the EEPROM layout migrations.
+//
+// Builds mf_src/eeprom.c natively over a model of the AVR's 512 byte EEPROM
+// and boots it from images of every layout it migrates, 3 to 8. Each boot
+// must keep the values the old layout had, give the parts it lacked their
+// defaults and leave the settings where layout 9 keeps them. The layout 8
+// images have the newest journal record in every slot, with the journal
+// full or only partly written.
+//
+// Every migration is also cut short by a power loss after each of its
+// writes in turn, and then booted again, which must end with the same
+// EEPROM. Images with settings out of range or a version we don't know
+// must be reset to the factory defaults, which are taken from booting an
+// erased EEPROM.
+//
+// Build and run on the host with "make check", or:
+//
+//     make eepromtest && ./eepromtest
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../mf_src/eeprom.c"
+
+// What eeprom.c needs from the rest of the firmware.
+bool g_self_test_passed;
+uint8_t g_midi_channel;
+uint8_t g_midi_velocity;
+bool g_led_keypress_enable;
+uint8_t g_key_fourbanks_mode;
+uint8_t g_key_bank_selected;
+uint8_t g_exp_digital_read;
+uint8_t g_exp_analog_read;
+volatile uint8_t SREG;
+
+void led_set_state(uint16_t new_state) { (void)new_state; }
+void analog_measure_noise(void) {}
+
+// EEPROM model ---------------------------------------------------------------
+
+#define EEPROM_SIZE 512
+#define NO_CUT -1
+
+// Shared with the boots, which run in child processes so that each one
+// starts with the firmware's variables as they are at power on.
+typedef struct {
+    uint8_t mem[EEPROM_SIZE];     // The EEPROM cells
+    int writes;                   // Writes finished by the last boot
+    int cut;                      // Writes to allow before the power goes
+    eeprom_settings_t globals;    // The global values the boot set up
+} board_t;
+
+static board_t* board;
+
+volatile uint16_t EEAR;
+static uint8_t eecr;
+static uint8_t eedr;
+
+// A write started by setting EEPE finishes the next time the firmware
+// looks at EECR, which it always does before touching EEAR again. The
+// power goes as the write after the last allowed one would start.
+volatile uint8_t* host_eecr(void)
+{
+    if (eecr & (1<<EEPE)) {
+        if (board->writes == board->cut) _exit(3);
+        board->mem[EEAR % EEPROM_SIZE] = eedr;
+        ++board->writes;
+        eecr &= ~((1<<EEPE) | (1<<EEMPE));
+    }
+    return &eecr;
+}
+
+// A read started by setting EERE loads EEDR from the cell at EEAR.
+volatile uint8_t* host_eedr(void)
+{
+    if (eecr & (1<<EERE)) {
+        eedr = board->mem[EEAR % EEPROM_SIZE];
+        eecr &= ~(1<<EERE);
+    }
+    return &eedr;
+}
+
+// Boot the firmware on "image", allowing "cut" writes, or NO_CUT. The
+// writes left waiting when eeprom_setup() returns are flushed, as the main
+// loop would. Returns true if the boot finished, leaving the EEPROM in
+// "image".
+static bool boot(uint8_t image[EEPROM_SIZE], int cut)
+{
+    memcpy(board->mem, image, EEPROM_SIZE);
+    board->writes = 0;
+    board->cut = cut;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("eepromtest: fork");
+        exit(2);
+    }
+    if (pid == 0) {
+        eeprom_setup();
+        eeprom_flush();
+        board->globals.first_boot_check = g_self_test_passed;
+        board->globals.midi_channel = g_midi_channel;
+        board->globals.midi_velocity = g_midi_velocity;
+        board->globals.keypress_led = g_led_keypress_enable;
+        board->globals.fourbanks = g_key_fourbanks_mode;
+        board->globals.exp_digital = g_exp_digital_read;
+        board->globals.exp_analog = g_exp_analog_read;
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    memcpy(image, board->mem, EEPROM_SIZE);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 3) return false;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "eepromtest: a boot crashed\n");
+        exit(2);
+    }
+    return true;
+}
+
+// Checks ---------------------------------------------------------------------
+
+static int checks = 0;
+static const char* test;          // The image being booted
+
+static void check(int ok, const char* what, int detail)
+{
+    ++checks;
+    if (!ok) {
+        fprintf(stderr, "eepromtest: %s: %s (%d)\n", test, what, detail);
+        exit(1);
+    }
+}
+
+// The settings of the newest valid record in the layout 9 journal.
+static eeprom_settings_t journal_newest(const uint8_t image[EEPROM_SIZE])
+{
+    eeprom_settings_t settings;
+    bool found = false;
+    uint8_t seq = 0;
+    memset(&settings, 0, sizeof(settings));
+    for (int slot=0; slot < EE_JOURNAL_SLOTS; ++slot) {
+        const uint8_t* record = &image[EE_JOURNAL + slot * EE_JOURNAL_RECORD];
+        uint8_t crc = EEPROM_CRC_SEED;
+        for (int i=0; i < EE_JOURNAL_RECORD - 1; ++i) {
+            crc = _crc_ibutton_update(crc, record[i]);
+        }
+        if (crc != record[EE_JOURNAL_RECORD - 1]) continue;
+        if (record[0] == EEPROM_SEQ_ERASED) continue;
+        if (found && (int8_t)(record[0] - seq) <= 0) continue;
+        found = true;
+        seq = record[0];
+        memcpy(&settings.midi_channel, &record[1], EE_PRESET_SIZE);
+    }
+    check(found, "no valid journal record", 0);
+    return settings;
+}
+
+// Check a finished boot left the cells below the journal as "expected",
+// the newest journal record holding "settings" and the globals set to
+// them. A second boot must then find nothing to write.
+static void check_booted(const uint8_t image[EEPROM_SIZE],
+                         const uint8_t expected[EEPROM_SIZE],
+                         const eeprom_settings_t* settings)
+{
+    for (int address=0; address < EE_JOURNAL; ++address) {
+        check(image[address] == expected[address], "wrong value at address",
+              address);
+    }
+    eeprom_settings_t journal = journal_newest(image);
+    check(!memcmp(&journal.midi_channel, &settings->midi_channel,
+                  EE_PRESET_SIZE), "wrong settings in the journal", 0);
+    check(!memcmp(&board->globals.midi_channel, &settings->midi_channel,
+                  EE_PRESET_SIZE), "wrong settings in the globals", 0);
+    check(board->globals.first_boot_check == (expected[EE_FIRST_BOOT_CHECK] != 0),
+          "wrong first boot check in the globals", 0);
+
+    uint8_t again[EEPROM_SIZE];
+    memcpy(again, image, EEPROM_SIZE);
+    check(boot(again, NO_CUT), "second boot was cut", 0);
+    check(board->writes == 0, "second boot wrote to the EEPROM", board->writes);
+}
+
+// Images ---------------------------------------------------------------------
+
+// The parts of layout 9 after the settings block, and the layout that
+// added each one.
+static const struct {
+    uint16_t address;
+    uint16_t length;
+    uint8_t since;
+} parts[] = {
+    { EE_ANALOG_CALIBRATION, 4 * NUM_ANALOG,                 4 },
+    { EE_ANALOG_CURVE,       NUM_ANALOG,                     5 },
+    { EE_CURVE_CUSTOM,       128,                            5 },
+    { EE_ANALOG_MAP,         ANALOG_MUX_PINS,                6 },
+    { EE_COMBO_COUNT,        1,                              7 },
+    { EE_PRESETS,            NUM_PRESETS * EE_PRESET_SIZE,   9 },
+};
+#define NUM_PARTS (sizeof(parts) / sizeof(parts[0]))
+
+// The EEPROM after a factory reset, from booting an erased one.
+static uint8_t factory[EEPROM_SIZE];
+static eeprom_settings_t factory_settings;
+
+// Settings that aren't the defaults, and an older set for the records the
+// layout 8 journal holds before the newest.
+static const eeprom_settings_t custom = { 0, 0, 5, 100, 0, 1, 0x03, 0x05 };
+static const eeprom_settings_t older = { 0, 0, 9, 50, 1, 2, 0x0f, 0x00 };
+
+// An image of layout "version" holding the settings "settings" at their
+// own addresses, with every cell after them that isn't the journal filled
+// with values that aren't the defaults.
+static void make_image(uint8_t image[EEPROM_SIZE], uint8_t version,
+                       const eeprom_settings_t* settings)
+{
+    memset(image, 0xff, EEPROM_SIZE);
+    for (int address=EE_SETTINGS_SIZE; address < EE_PRESETS; ++address) {
+        image[address] = address * 7 + version;
+    }
+    memcpy(image, settings, EE_SETTINGS_SIZE);
+    image[EE_EEPROM_VERSION] = version;
+    image[EE_FIRST_BOOT_CHECK] = 1;
+}
+
+// Write a record of "settings" with sequence number "seq" into slot "slot"
+// of the layout 8 journal.
+static void write_record_8(uint8_t image[EEPROM_SIZE], int slot, uint8_t seq,
+                           const eeprom_settings_t* settings)
+{
+    uint8_t* record = &image[EE_PRESETS + slot * EE_JOURNAL_RECORD];
+    record[0] = seq;
+    memcpy(&record[1], &settings->midi_channel, EE_PRESET_SIZE);
+    uint8_t crc = EEPROM_CRC_SEED;
+    for (int i=0; i < EE_JOURNAL_RECORD - 1; ++i) {
+        crc = _crc_ibutton_update(crc, record[i]);
+    }
+    record[EE_JOURNAL_RECORD - 1] = crc;
+}
+
+// An image of layout 8 with "settings" in the newest journal record, in
+// slot "newest". The records before it go back to slot 0, or round the
+// whole journal if "full", and the cells the settings used to be at hold
+// old values.
+static void make_image_8(uint8_t image[EEPROM_SIZE], int newest, bool full,
+                         const eeprom_settings_t* settings)
+{
+    make_image(image, 8, &older);
+    uint8_t seq = 250 + newest;   // wraps partway through for some slots
+    for (int back=1; back < 16; ++back) {
+        int slot = newest - back;
+        if (slot < 0) {
+            if (!full) break;
+            slot += 16;
+        }
+        write_record_8(image, slot, seq - back, &older);
+    }
+    write_record_8(image, newest, seq, settings);
+}
+
+// What a migration of "image" must leave below the journal: its values
+// kept, and the defaults for the parts its layout didn't have.
+static void migrated(uint8_t expected[EEPROM_SIZE], const uint8_t image[EEPROM_SIZE])
+{
+    memcpy(expected, image, EEPROM_SIZE);
+    expected[EE_EEPROM_VERSION] = EEPROM_VERSION;
+    for (unsigned i=0; i < NUM_PARTS; ++i) {
+        if (parts[i].since > image[EE_EEPROM_VERSION]) {
+            memcpy(&expected[parts[i].address], &factory[parts[i].address],
+                   parts[i].length);
+        }
+    }
+}
+
+// What a factory reset of "image" must leave below the journal. Cells it
+// doesn't own, like the uploaded combo rules, are left as they were.
+static void reset(uint8_t expected[EEPROM_SIZE], const uint8_t image[EEPROM_SIZE])
+{
+    memcpy(expected, image, EEPROM_SIZE);
+    expected[EE_EEPROM_VERSION] = factory[EE_EEPROM_VERSION];
+    expected[EE_FIRST_BOOT_CHECK] = factory[EE_FIRST_BOOT_CHECK];
+    for (unsigned i=0; i < NUM_PARTS; ++i) {
+        memcpy(&expected[parts[i].address], &factory[parts[i].address],
+               parts[i].length);
+    }
+}
+
+// Tests ----------------------------------------------------------------------
+
+// Boot an erased EEPROM, which must be reset, and keep the result as the
+// factory defaults.
+static void test_factory(void)
+{
+    test = "erased";
+    memset(factory, 0xff, EEPROM_SIZE);
+    check(boot(factory, NO_CUT), "boot was cut", 0);
+    factory_settings = journal_newest(factory);
+    check(factory[EE_EEPROM_VERSION] == EEPROM_VERSION, "wrong version", 0);
+    check(factory_settings.midi_channel == 2, "wrong default channel", 0);
+    check(factory_settings.midi_velocity == 127, "wrong default velocity", 0);
+    check(factory[EE_COMBO_COUNT] == 0, "combos not reset", 0);
+    for (int i=0; i < NUM_PRESETS; ++i) {
+        check(factory[EE_PRESETS + i * EE_PRESET_SIZE] == 2 + i,
+              "wrong default preset channel", i);
+    }
+    check(!memcmp(&board->globals.midi_channel, &factory_settings.midi_channel,
+                  EE_PRESET_SIZE), "wrong settings in the globals", 0);
+}
+
+// Migrate "image" holding "settings", whole and then cut short after each
+// of its writes in turn.
+static void test_migration(const uint8_t image[EEPROM_SIZE],
+                           const eeprom_settings_t* settings)
+{
+    uint8_t expected[EEPROM_SIZE];
+    uint8_t booted[EEPROM_SIZE];
+    migrated(expected, image);
+
+    memcpy(booted, image, EEPROM_SIZE);
+    check(boot(booted, NO_CUT), "boot was cut", 0);
+    int writes = board->writes;
+    check_booted(booted, expected, settings);
+
+    for (int cut=0; cut < writes; ++cut) {
+        memcpy(booted, image, EEPROM_SIZE);
+        check(!boot(booted, cut), "boot wasn't cut", cut);
+        // Lose the power again at the same point of the next boot.
+        boot(booted, cut);
+        check(boot(booted, NO_CUT), "boot was cut", cut);
+        check_booted(booted, expected, settings);
+    }
+}
+
+static void test_layouts(void)
+{
+    uint8_t image[EEPROM_SIZE];
+    static char name[64];
+    test = name;
+    for (uint8_t version=EEPROM_OLDEST_VERSION; version < 8; ++version) {
+        snprintf(name, sizeof(name), "layout %d", version);
+        make_image(image, version, &custom);
+        test_migration(image, &custom);
+    }
+    for (int newest=0; newest < 16; ++newest) {
+        for (int full=0; full < 2; ++full) {
+            snprintf(name, sizeof(name), "layout 8, newest record in slot %d%s",
+                     newest, full ? ", journal full" : "");
+            make_image_8(image, newest, full, &custom);
+            test_migration(image, &custom);
+        }
+    }
+}
+
+// Boot "image", which must be reset to the factory defaults.
+static void test_reset(const char* name, const uint8_t image[EEPROM_SIZE])
+{
+    uint8_t expected[EEPROM_SIZE];
+    uint8_t booted[EEPROM_SIZE];
+    test = name;
+    reset(expected, image);
+    memcpy(booted, image, EEPROM_SIZE);
+    check(boot(booted, NO_CUT), "boot was cut", 0);
+    check_booted(booted, expected, &factory_settings);
+}
+
+static void test_resets(void)
+{
+    uint8_t image[EEPROM_SIZE];
+    eeprom_settings_t settings;
+
+    settings = custom;
+    settings.midi_channel = 0x10;
+    make_image(image, 7, &settings);
+    test_reset("layout 7, channel out of range", image);
+
+    settings = custom;
+    settings.midi_velocity = 0x80;
+    make_image(image, EEPROM_OLDEST_VERSION, &settings);
+    test_reset("layout 3, velocity out of range", image);
+
+    settings = custom;
+    settings.fourbanks = FOURBANKS_EXTERNAL + 1;
+    make_image_8(image, 5, true, &settings);
+    test_reset("layout 8, fourbanks mode out of range", image);
+
+    settings = custom;
+    settings.exp_analog = 0x10;
+    make_image_8(image, 1, false, &settings);
+    test_reset("layout 8, analog pins out of range", image);
+
+    static const uint8_t unknown[] = { 0, 1, 2, EEPROM_VERSION + 1, 0x80 };
+    for (unsigned i=0; i < sizeof(unknown); ++i) {
+        make_image(image, unknown[i], &custom);
+        test_reset("unknown layout", image);
+    }
+
+    make_image(image, EEPROM_VERSION, &custom);
+    test_reset("layout 9 without a journal", image);
+}
+
+int main(void)
+{
+    board = mmap(NULL, sizeof(board_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (board == MAP_FAILED) {
+        perror("eepromtest: mmap");
+        return 2;
+    }
+    test_factory();
+    test_layouts();
+    test_resets();
+    printf("eepromtest: %d checks passed\n", checks);
+    return 0;
+}
@@ -0,0 +1,3 @@
+// Host stand-in for LUFA's MIDI class driver. See ../../../../README.
+
+#include "../USB.h"
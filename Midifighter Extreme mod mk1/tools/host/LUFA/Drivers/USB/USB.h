@@ -0,0 +1,9 @@
+// Host stand-in for LUFA's USB.h. See ../../../README. Only the types the
+// firmware headers mention.
+
+#ifndef _HOST_LUFA_USB_H_INCLUDED
+#define _HOST_LUFA_USB_H_INCLUDED
+
+typedef struct USB_ClassInfo_MIDI_Device USB_ClassInfo_MIDI_Device_t;
+
+#endif
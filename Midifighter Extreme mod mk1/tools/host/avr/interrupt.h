@@ -0,0 +1,13 @@
+// Host stand-in for <avr/interrupt.h>. See ../README. Interrupts never
+// fire on the host; tools call the handlers they need themselves.
+
+#ifndef _HOST_AVR_INTERRUPT_H_INCLUDED
+#define _HOST_AVR_INTERRUPT_H_INCLUDED
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+#define cli()
+#define sei()
+
+#endif
@@ -0,0 +1,42 @@
+// Host stand-in for <avr/io.h>. See ../README.
+
+#ifndef _HOST_AVR_IO_H_INCLUDED
+#define _HOST_AVR_IO_H_INCLUDED
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t PORTB, PORTC, PORTD;
+extern volatile uint8_t DDRB, DDRC, DDRD;
+extern volatile uint8_t SREG;
+
+// The EEPROM. EECR and EEDR are modelled by the tool, see host_eecr() and
+// host_eedr().
+extern volatile uint16_t EEAR;
+volatile uint8_t* host_eecr(void);
+volatile uint8_t* host_eedr(void);
+#define EECR (*host_eecr())
+#define EEDR (*host_eedr())
+#define EERE  0
+#define EEPE  1
+#define EEMPE 2
+#define EERIE 3
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PC7 7
+#define PD0 0
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+
+#endif
@@ -0,0 +1,18 @@
+// Host stand-in for <avr/pgmspace.h>. See ../README. Program memory is
+// ordinary memory on the host.
+
+#ifndef _HOST_AVR_PGMSPACE_H_INCLUDED
+#define _HOST_AVR_PGMSPACE_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+// Reads the whole element, so that tables of function pointers work with
+// host pointer sizes.
+#define pgm_read_word(p) (*(p))
+#define memcpy_P memcpy
+
+#endif
@@ -0,0 +1,18 @@
+// Host stand-in for <util/crc16.h>. See ../README.
+
+#ifndef _HOST_UTIL_CRC16_H_INCLUDED
+#define _HOST_UTIL_CRC16_H_INCLUDED
+
+#include <stdint.h>
+
+// The Dallas iButton CRC-8, as in avr-libc.
+static inline uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (uint8_t i=0; i<8; ++i) {
+        crc = (crc & 0x01) ? (crc >> 1) ^ 0x8c : crc >> 1;
+    }
+    return crc;
+}
+
+#endif
@@ -0,0 +1,9 @@
+// Host stand-in for <util/delay.h>. See ../README. Delays take no time.
+
+#ifndef _HOST_UTIL_DELAY_H_INCLUDED
+#define _HOST_UTIL_DELAY_H_INCLUDED
+
+#define _delay_ms(ms) ((void)(ms))
+#define _delay_us(us) ((void)(us))
+
+#endif
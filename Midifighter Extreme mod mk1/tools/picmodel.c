@@ -0,0 +1,355 @@
+// Host-side model of the AVR to PIC LED protocol.
+//
+// Builds the AVR side of the protocol, mf_src/mod.c, natively and feeds the
+// bytes it sends through a model of the PIC's SPI receive interrupt in
+// pic_src/main.s, then checks what the PIC ends up showing. The checks
+// cover every LED state, the delta-only sending and refresh, brightness
+// frames, and frames that are corrupted, cut short or mixed with stray
+// bytes on the wire, each followed by a good frame to prove the PIC
+// resynchronises.
+//
+// Build and run on the host with "make check", or:
+//
+//     make picmodel && ./picmodel
+//
+// The model has to be kept in step with __SPI1Interrupt by hand, as the
+// PIC assembly can't be run here.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mf_src/mod.c"
+
+// AVR side -------------------------------------------------------------------
+
+// Everything mod.c sends over SPI, in order.
+static uint8_t wire[4096];
+static int wire_len = 0;
+
+static uint16_t host_ticks = 0;
+
+uint8_t spi_transmit(uint8_t byte)
+{
+    if (wire_len < (int)sizeof(wire)) wire[wire_len++] = byte;
+    return 0;
+}
+
+void spi_post(uint8_t id) { (void)id; }
+void spi_install_slave(uint8_t id, uint8_t port, uint8_t pin, uint8_t select_with)
+{
+    (void)id; (void)port; (void)pin; (void)select_with;
+}
+void spi_configure_slave(uint8_t id, uint8_t divider, uint8_t mode)
+{
+    (void)id; (void)divider; (void)mode;
+}
+void spi_install_client(uint8_t id, uint8_t priority, uint16_t budget_us, spi_flush_t flush)
+{
+    (void)id; (void)priority; (void)budget_us; (void)flush;
+}
+uint16_t key_ticks(void) { return host_ticks; }
+void led_set_state(uint16_t new_state) { (void)new_state; }
+
+// Run the bus scheduler's calls to pic_flush() until it has nothing left,
+// and return the number of bytes sent.
+static int avr_drain(void)
+{
+    wire_len = 0;
+    while (pic_flush()) {}
+    return wire_len;
+}
+
+// PIC side -------------------------------------------------------------------
+
+// The state of __SPI1Interrupt: FRAME_POS, FRAME_CMD, FRAME_SUM and
+// FRAME_P0..2, and the variables it writes.
+typedef struct {
+    uint8_t pos;
+    uint8_t cmd;
+    uint8_t sum;
+    uint8_t payload[3];
+    uint16_t led_state;
+    uint8_t led_state_hi;
+    uint8_t brightness[NUM_EXTERNAL_LEDS];
+    int watchdog_clears;
+} pic_t;
+
+static pic_t pic;
+
+static void pic_reset(void)
+{
+    memset(&pic, 0, sizeof(pic));
+    memset(pic.brightness, 0x7f, sizeof(pic.brightness));
+}
+
+// One byte received, as __SPI1Interrupt handles it.
+static void pic_receive(uint8_t byte)
+{
+    // A command byte always starts a new frame.
+    if (byte & 0x80) {
+        pic.cmd = byte;
+        pic.sum = byte;
+        pic.pos = 1;
+        return;
+    }
+    // Payload bytes outside a frame are ignored.
+    if (pic.pos == 0) return;
+    if (pic.pos < 4) {
+        pic.sum ^= byte;
+        pic.payload[pic.pos - 1] = byte;
+        ++pic.pos;
+        return;
+    }
+
+    // The checksum byte ends the frame either way.
+    pic.pos = 0;
+    if ((pic.sum & 0x7f) != byte) return;
+    if (pic.cmd == PIC_CMD_LEDS) {
+        pic.led_state = pic.payload[0] | (pic.payload[1] << 7) | (pic.payload[2] << 14);
+        pic.led_state_hi = (pic.payload[2] >> 2) & 0x01;
+        ++pic.watchdog_clears;
+    } else if (pic.cmd == PIC_CMD_BRIGHTNESS) {
+        if (pic.payload[0] == PIC_ALL_LEDS) {
+            memset(pic.brightness, pic.payload[1], sizeof(pic.brightness));
+        } else if (pic.payload[0] < NUM_EXTERNAL_LEDS) {
+            pic.brightness[pic.payload[0]] = pic.payload[1];
+        }
+    }
+}
+
+static void pic_receive_all(const uint8_t* bytes, int length)
+{
+    for (int i=0; i < length; ++i) pic_receive(bytes[i]);
+}
+
+// The 17 LED bits the PIC is showing.
+static uint32_t pic_leds(void)
+{
+    return pic.led_state | ((uint32_t)pic.led_state_hi << 16);
+}
+
+// Checks ---------------------------------------------------------------------
+
+static int checks = 0;
+
+static void check(int ok, const char* what, uint32_t detail)
+{
+    ++checks;
+    if (!ok) {
+        fprintf(stderr, "picmodel: %s (0x%05x)\n", what, (unsigned)detail);
+        exit(1);
+    }
+}
+
+// Post LED state "leds" through pic_post(), as set_external_leds() does,
+// and return the frame it sent, if any.
+static int post(uint32_t leds, uint8_t frame[PIC_FRAME_SIZE])
+{
+    pic_post(leds & 0xff, (leds >> 8) & 0xff, (leds >> 16) & 0x01);
+    int sent = avr_drain();
+    if (sent == PIC_FRAME_SIZE) memcpy(frame, wire, PIC_FRAME_SIZE);
+    return sent;
+}
+
+// Get the PIC showing "leds" from a clean frame.
+static void show(uint32_t leds)
+{
+    uint8_t frame[PIC_FRAME_SIZE];
+    host_ticks += PIC_REFRESH_TICKS;
+    check(post(leds, frame) == PIC_FRAME_SIZE, "no frame for a refresh", leds);
+    pic_receive_all(frame, PIC_FRAME_SIZE);
+    check(pic_leds() == leds, "PIC shows the wrong LEDs", leds);
+}
+
+// Every one of the 17-bit LED states gets across, one frame each.
+static void check_every_state(void)
+{
+    pic_reset();
+    for (uint32_t leds = 0; leds < 0x20000; ++leds) {
+        uint8_t frame[PIC_FRAME_SIZE];
+        check(post(leds, frame) == PIC_FRAME_SIZE, "changed state not sent as one frame", leds);
+        for (int i=1; i < PIC_FRAME_SIZE; ++i) {
+            check(!(frame[i] & 0x80), "payload byte with the top bit set", leds);
+        }
+        pic_receive_all(frame, PIC_FRAME_SIZE);
+        check(pic_leds() == leds, "PIC shows the wrong LEDs", leds);
+    }
+}
+
+// Unchanged state is only resent as a refresh, and only the latest of
+// several posts goes out.
+static void check_delta_only(void)
+{
+    uint8_t frame[PIC_FRAME_SIZE];
+    pic_reset();
+    host_ticks = 0xffff - PIC_REFRESH_TICKS / 2;   // across the tick wrap
+    show(0x10203);
+
+    check(post(0x10203, frame) == 0, "unchanged state resent", 0x10203);
+    host_ticks += PIC_REFRESH_TICKS - 1;
+    check(post(0x10203, frame) == 0, "refresh sent early", 0x10203);
+    host_ticks += 1;
+    check(post(0x10203, frame) == PIC_FRAME_SIZE, "refresh not sent", 0x10203);
+
+    int clears = pic.watchdog_clears;
+    pic_receive_all(frame, PIC_FRAME_SIZE);
+    check(pic.watchdog_clears == clears + 1, "refresh didn't feed the watchdog", 0x10203);
+
+    pic_post(0x01, 0x00, 0x00);
+    pic_post(0x02, 0x00, 0x00);
+    check(avr_drain() == PIC_FRAME_SIZE, "stale frame sent as well as the latest", 0x02);
+    pic_receive_all(wire, wire_len);
+    check(pic_leds() == 0x02, "latest state not shown", 0x02);
+}
+
+// Brightness changes go out one frame each, after the LED state, and the
+// PIC handles single LEDs, all LEDs and LED numbers it doesn't have.
+static void check_brightness(void)
+{
+    pic_reset();
+    show(0x00000);
+
+    pic_post(0xff, 0xff, 0x01);
+    for (uint8_t led=0; led < NUM_EXTERNAL_LEDS; ++led) {
+        set_external_led_brightness(led, led * 7);
+    }
+    set_external_led_brightness(NUM_EXTERNAL_LEDS, 1);
+    int sent = avr_drain();
+    check(sent == (1 + NUM_EXTERNAL_LEDS) * PIC_FRAME_SIZE, "wrong number of frames", sent);
+    check(wire[0] == PIC_CMD_LEDS, "LED state not sent first", wire[0]);
+    pic_receive_all(wire, wire_len);
+    check(pic_leds() == 0x1ffff, "LED state lost among brightness frames", pic_leds());
+    for (uint8_t led=0; led < NUM_EXTERNAL_LEDS; ++led) {
+        check(pic.brightness[led] == led * 7, "wrong brightness", led);
+    }
+
+    set_external_led_brightness(3, 3 * 7);
+    check(avr_drain() == 0, "unchanged brightness resent", 3);
+
+    // Every LED at once is one frame, replacing those still waiting, and
+    // an LED set after it is sent after it.
+    set_external_led_brightness(5, 0x11);
+    set_external_led_brightness(PIC_ALL_LEDS, 0x30);
+    set_external_led_brightness(6, 0x12);
+    sent = avr_drain();
+    check(sent == 2 * PIC_FRAME_SIZE, "wrong number of frames for all LEDs", sent);
+    check(wire[1] == PIC_ALL_LEDS, "all-LEDs frame not sent first", wire[1]);
+    pic_receive_all(wire, wire_len);
+    for (uint8_t led=0; led < NUM_EXTERNAL_LEDS; ++led) {
+        check(pic.brightness[led] == (led == 6 ? 0x12 : 0x30),
+              "wrong brightness after all LEDs", led);
+    }
+    set_external_led_brightness(4, 0x30);
+    check(avr_drain() == 0, "brightness set by all LEDs resent", 4);
+
+    const uint8_t all[] = { PIC_CMD_BRIGHTNESS, PIC_ALL_LEDS, 0x20, 0x00,
+                            (PIC_CMD_BRIGHTNESS ^ PIC_ALL_LEDS ^ 0x20) & 0x7f };
+    pic_receive_all(all, sizeof(all));
+    for (uint8_t led=0; led < NUM_EXTERNAL_LEDS; ++led) {
+        check(pic.brightness[led] == 0x20, "all-LEDs brightness missed one", led);
+    }
+
+    const uint8_t bad[] = { PIC_CMD_BRIGHTNESS, NUM_EXTERNAL_LEDS, 0x10, 0x00,
+                            (PIC_CMD_BRIGHTNESS ^ NUM_EXTERNAL_LEDS ^ 0x10) & 0x7f };
+    pic_receive_all(bad, sizeof(bad));
+    for (uint8_t led=0; led < NUM_EXTERNAL_LEDS; ++led) {
+        check(pic.brightness[led] == 0x20, "out of range LED changed a brightness", led);
+    }
+}
+
+// A frame for "leds", as mod.c sends it.
+static void frame_for(uint32_t leds, uint8_t frame[PIC_FRAME_SIZE])
+{
+    host_ticks += PIC_REFRESH_TICKS;
+    check(post(leds, frame) == PIC_FRAME_SIZE, "no frame for a refresh", leds);
+}
+
+// A damaged frame must never change what the PIC shows, and the good frame
+// after it must get through.
+static void check_damaged(const uint8_t* bytes, int length, uint32_t before, uint32_t after)
+{
+    int clears = pic.watchdog_clears;
+    pic_receive_all(bytes, length);
+    check(pic_leds() == before, "damaged frame was shown", after);
+    check(pic.watchdog_clears == clears, "damaged frame fed the watchdog", after);
+
+    uint8_t good[PIC_FRAME_SIZE];
+    frame_for(after, good);
+    pic_receive_all(good, PIC_FRAME_SIZE);
+    check(pic_leds() == after, "no resync after a damaged frame", after);
+}
+
+// Every single bit error in a frame is caught: a top bit error by the
+// framing, any other by the checksum.
+static void check_bit_errors(void)
+{
+    const uint32_t states[] = { 0x00000, 0x1ffff, 0x15555, 0x0aaaa, 0x10f0f };
+    pic_reset();
+    for (unsigned s=0; s < sizeof(states) / sizeof(states[0]); ++s) {
+        uint32_t target = states[s];
+        uint32_t before = ~target & 0x1ffff;
+        for (int byte=0; byte < PIC_FRAME_SIZE; ++byte) {
+            for (int bit=0; bit < 8; ++bit) {
+                show(before);
+                uint8_t frame[PIC_FRAME_SIZE];
+                frame_for(target, frame);
+                frame[byte] ^= 1 << bit;
+                check_damaged(frame, PIC_FRAME_SIZE, before, target);
+            }
+        }
+    }
+}
+
+// Frames cut short, missing a byte or interrupted by the next command are
+// dropped, and stray payload bytes and unknown commands are ignored.
+static void check_lost_bytes(void)
+{
+    const uint32_t before = 0x0f0f0;
+    const uint32_t target = 0x10f0f;
+    uint8_t frame[PIC_FRAME_SIZE];
+    uint8_t damaged[PIC_FRAME_SIZE];
+    pic_reset();
+
+    // Cut short after each byte.
+    for (int length=1; length < PIC_FRAME_SIZE; ++length) {
+        show(before);
+        frame_for(target, frame);
+        check_damaged(frame, length, before, target);
+    }
+
+    // One byte lost from the middle, as when the PIC's receiver overruns.
+    for (int lost=0; lost < PIC_FRAME_SIZE; ++lost) {
+        show(before);
+        frame_for(target, frame);
+        int n = 0;
+        for (int i=0; i < PIC_FRAME_SIZE; ++i) {
+            if (i != lost) damaged[n++] = frame[i];
+        }
+        check_damaged(damaged, n, before, target);
+    }
+
+    // Stray payload bytes between frames.
+    show(before);
+    for (int byte=0; byte < 0x80; ++byte) {
+        damaged[0] = byte;
+        check_damaged(damaged, 1, pic_leds(), (byte & 1) ? target : before);
+    }
+
+    // A command we don't know, with a good checksum.
+    show(before);
+    const uint8_t unknown[] = { 0x82, 0x7f, 0x7f, 0x01, (0x82 ^ 0x01) & 0x7f };
+    check_damaged(unknown, sizeof(unknown), before, target);
+}
+
+int main(void)
+{
+    mod_setup();
+    check_every_state();
+    check_delta_only();
+    check_brightness();
+    check_bit_errors();
+    check_lost_bytes();
+    printf("picmodel: %d checks passed\n", checks);
+    return 0;
+}